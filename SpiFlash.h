@@ -32,231 +32,1864 @@ THE SOFTWARE.
 #ifdef ARDUINO
 #include <Arduino.h>
 #else
+#include <sched.h>
 #include <time.h>
 #endif
 
+#if defined(__SSE2__) && !defined(ARDUINO)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE4_2__) && !defined(ARDUINO)
+#include <nmmintrin.h>
+#endif
+
 enum SpiFlashError {
 	SpiFlashErrorSuccess,
 	SpiFlashErrorTimeout,
 	SpiFlashErrorAccessDenied,
-	SpiFlashErrorInputValue
+	SpiFlashErrorInputValue,
+	SpiFlashErrorBusy,
+	SpiFlashErrorVerify
+};
+
+//! Identifies an operation started with one of the SpiFlash::begin calls.
+typedef uint16_t SpiFlashHandle;
+
+//! Called by SpiFlash::poll() when a started operation completed.
+//! \param handle Handle of the operation.
+//! \param result SpiFlashErrorSuccess or non-zero if any error.
+//! \param context Context given to SpiFlash::onComplete().
+typedef void (*SpiFlashCallback)(SpiFlashHandle handle, int result,
+	void* context);
+
+//! Called by SpiFlash::write() on each page payload before it is programmed,
+//! e.g. to encrypt or whiten it in place.
+//! \param page Payload, programmed at offset.
+//! \param length Payload length, at most one page.
+//! \param offset Flash offset of the payload.
+//! \param context Context given to SpiFlash::write().
+typedef void (*SpiFlashPageTransform)(uint8_t* page, size_t length,
+	uint32_t offset, void* context);
+
+//! Operations the flash stays busy for, used to look up their duration.
+enum SpiFlashOperation {
+	SpiFlashOperationNone,
+	SpiFlashOperationPageProgram,
+	SpiFlashOperationSectorErase,
+	SpiFlashOperationBlockErase32K,
+	SpiFlashOperationBlockErase64K,
+	SpiFlashOperationChipErase,
+	SpiFlashOperationWriteStatus,
+	SpiFlashOperationReleasePowerDown,
+	SpiFlashOperationSuspend,
+	SpiFlashOperationResume
+};
+
+//! Erase commands chosen by SpiFlash::erase() for a range and their total
+//! typical duration. skipped counts the sectors a blank check found erased.
+struct SpiFlashErasePlan {
+	uint32_t sectors;
+	uint32_t blocks32K;
+	uint32_t blocks64K;
+	bool chip;
+	uint32_t typicalMs;
+	uint32_t skipped;
+};
+
+//! Whether SpiFlash::write() checks what it programmed.
+enum SpiFlashWriteMode {
+	//! Program only.
+	SpiFlashWriteProgram,
+	//! Read back each page after programming and compare its CRC-32C with
+	//! the one of the data sent, retrying a failing page once.
+	SpiFlashWriteVerify
+};
+
+//! How SpiFlash::erase() treats sectors that are already erased.
+enum SpiFlashEraseMode {
+	//! Erase the whole range.
+	SpiFlashEraseAll,
+	//! Read each sector first and erase only those not blank, saving erase
+	//! time and endurance cycles when most of the range is erased.
+	SpiFlashEraseBlankCheck
+};
+
+//! One multi-lane read transaction for the optional transferLanes() extension
+//! of the SpiDevice concept. The command is always sent on a single lane,
+//! followed by the address (and mode) bytes on addressLanes, dummyClocks idle
+//! clocks and finally length bytes received into data on dataLanes. In
+//! continuous read mode skipCommand is set and the command phase is omitted.
+//! Within a phase, bytes are sent MSB first: on two lanes IO1 carries the odd
+//! and IO0 the even bits, on four lanes IO3..IO0 carry the high nibble first.
+struct SpiFlashLaneTransfer {
+	uint8_t command;
+	bool skipCommand;
+	const uint8_t* address;
+	uint8_t addressLength;
+	uint8_t addressLanes;
+	uint8_t dummyClocks;
+	uint8_t* data;
+	size_t length;
+	uint8_t dataLanes;
+};
+
+namespace SpiFlashDetail {
+
+template<bool VALUE> struct Bool {};
+template<int VALUE> struct Int {};
+
+template<bool CONDITION, typename T, typename F>
+struct Conditional { typedef T Type; };
+template<typename T, typename F>
+struct Conditional<false, T, F> { typedef F Type; };
+
+typedef char Yes[1];
+typedef char No[2];
+
+//! Detects the optional split-phase read extension of the SpiDevice concept:
+//! void transferIn(const uint8_t* header, size_t headerLength,
+//!                 uint8_t* data, size_t length);
+//! It clocks out the header and then clocks the payload directly into data
+//! within a single chip select.
+template<typename Device>
+class HasTransferIn {
+	template<typename D>
+	static Yes& test(D* d, decltype(d->transferIn(
+		static_cast<const uint8_t*>(0), static_cast<size_t>(0),
+		static_cast<uint8_t*>(0), static_cast<size_t>(0)), void())* = 0);
+	template<typename D>
+	static No& test(...);
+public:
+	enum { value = (sizeof(test<Device>(0)) == sizeof(Yes)) };
+};
+
+//! Detects the optional multi-lane extension of the SpiDevice concept:
+//! void transferLanes(const SpiFlashLaneTransfer& transfer);
+template<typename Device>
+class HasTransferLanes {
+	template<typename D>
+	static Yes& test(D* d, decltype(d->transferLanes(
+		*static_cast<const SpiFlashLaneTransfer*>(0)), void())* = 0);
+	template<typename D>
+	static No& test(...);
+public:
+	enum { value = (sizeof(test<Device>(0)) == sizeof(Yes)) };
+};
+
+//! Whether all bytes are 0xFF. ANDs 16 bytes per step with SSE2 on the host,
+//! 32 bit words otherwise.
+inline bool isErased(const uint8_t* data, size_t length) {
+	size_t i = 0;
+#if defined(__SSE2__) && !defined(ARDUINO)
+	__m128i all = _mm_set1_epi8(static_cast<char>(0xFF));
+	for (; i + 16 <= length; i += 16) {
+		all = _mm_and_si128(all, _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(&data[i])));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(all,
+			_mm_set1_epi8(static_cast<char>(0xFF)))) != 0xFFFF) {
+		return false;
+	}
+#endif
+	uint32_t words = 0xFFFFFFFFul;
+	for (; i + 4 <= length; i += 4) {
+		uint32_t word;
+		memcpy(&word, &data[i], sizeof(word));
+		words &= word;
+	}
+	uint8_t bytes = 0xFF;
+	for (; i < length; i++) {
+		bytes &= data[i];
+	}
+	return words == 0xFFFFFFFFul && bytes == 0xFF;
+}
+
+//! Continues the CRC-32C (Castagnoli) crc over data; start with 0. Uses the
+//! SSE4.2 crc32 instruction on the host if enabled (-msse4.2), a 16 entry
+//! table otherwise.
+inline uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t length) {
+	crc = ~crc;
+	size_t i = 0;
+#if defined(__SSE4_2__) && !defined(ARDUINO)
+	for (; i + 4 <= length; i += 4) {
+		uint32_t word;
+		memcpy(&word, &data[i], sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+	}
+	for (; i < length; i++) {
+		crc = _mm_crc32_u8(crc, data[i]);
+	}
+#else
+	static const uint32_t TABLE[16] = {
+		0x00000000ul, 0x105EC76Ful, 0x20BD8EDEul, 0x30E349B1ul,
+		0x417B1DBCul, 0x5125DAD3ul, 0x61C69362ul, 0x7198540Dul,
+		0x82F63B78ul, 0x92A8FC17ul, 0xA24BB5A6ul, 0xB21572C9ul,
+		0xC38D26C4ul, 0xD3D3E1ABul, 0xE330A81Aul, 0xF36E6F75ul
+	};
+	for (; i < length; i++) {
+		crc ^= data[i];
+		crc = (crc >> 4) ^ TABLE[crc & 0x0F];
+		crc = (crc >> 4) ^ TABLE[crc & 0x0F];
+	}
+#endif
+	return ~crc;
+}
+
+//! Number of leading 0xFF bytes. Compares 16 bytes per step with SSE2 on the
+//! host, 32 bit words otherwise.
+inline size_t erasedPrefix(const uint8_t* data, size_t length) {
+	size_t i = 0;
+#if defined(__SSE2__) && !defined(ARDUINO)
+	const __m128i erased = _mm_set1_epi8(static_cast<char>(0xFF));
+	while (i + 16 <= length && _mm_movemask_epi8(_mm_cmpeq_epi8(erased,
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(&data[i])))) ==
+			0xFFFF) {
+		i += 16;
+	}
+#endif
+	for (; i + 4 <= length; i += 4) {
+		uint32_t word;
+		memcpy(&word, &data[i], sizeof(word));
+		if (word != 0xFFFFFFFFul) {
+			break;
+		}
+	}
+	while (i < length && data[i] == 0xFF) {
+		i++;
+	}
+	return i;
+}
+
+//! Number of trailing 0xFF bytes, see erasedPrefix().
+inline size_t erasedSuffix(const uint8_t* data, size_t length) {
+	size_t i = length;
+#if defined(__SSE2__) && !defined(ARDUINO)
+	const __m128i erased = _mm_set1_epi8(static_cast<char>(0xFF));
+	while (i >= 16 && _mm_movemask_epi8(_mm_cmpeq_epi8(erased,
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(&data[i - 16])))) ==
+			0xFFFF) {
+		i -= 16;
+	}
+#endif
+	for (; i >= 4; i -= 4) {
+		uint32_t word;
+		memcpy(&word, &data[i - 4], sizeof(word));
+		if (word != 0xFFFFFFFFul) {
+			break;
+		}
+	}
+	while (i > 0 && data[i - 1] == 0xFF) {
+		i--;
+	}
+	return length - i;
+}
+
+} // namespace SpiFlashDetail
+
+//! Read command policies for the ReadMode template parameter of SpiFlash.
+//! COMMAND is the read opcode, ADDRESS_LANES the lanes used for address and
+//! MODE_BYTES mode bytes (M7-0), DUMMY_CLOCKS the number of dummy clocks
+//! before the first data bit and DATA_LANES the lanes the data is read on.
+//! CONTINUOUS keeps the flash in continuous read mode between reads.
+
+//! Read Data (0x03), no dummy clocks. Limited to a lower SPI clock (50 MHz on
+//! W25Q) than the fast read commands.
+struct SpiFlashReadNormal {
+	enum {
+		COMMAND = 0x03, ADDRESS_LANES = 1, MODE_BYTES = 0, DUMMY_CLOCKS = 0,
+		DATA_LANES = 1, CONTINUOUS = 0
+	};
+};
+
+//! Fast Read (0x0B), eight dummy clocks. Runs at the full SPI clock.
+struct SpiFlashReadFast {
+	enum {
+		COMMAND = 0x0B, ADDRESS_LANES = 1, MODE_BYTES = 0, DUMMY_CLOCKS = 8,
+		DATA_LANES = 1, CONTINUOUS = 0
+	};
+};
+
+//! The multi-lane modes below need a SpiDevice with transferLanes(), without
+//! it SpiFlash falls back to SpiFlashReadFast. Quad modes set the QE bit in
+//! status register 2 on init().
+
+//! Fast Read Dual Output (0x3B), data on two lanes.
+struct SpiFlashReadDualOutput {
+	enum {
+		COMMAND = 0x3B, ADDRESS_LANES = 1, MODE_BYTES = 0, DUMMY_CLOCKS = 8,
+		DATA_LANES = 2, CONTINUOUS = 0
+	};
+};
+
+//! Fast Read Quad Output (0x6B), data on four lanes.
+struct SpiFlashReadQuadOutput {
+	enum {
+		COMMAND = 0x6B, ADDRESS_LANES = 1, MODE_BYTES = 0, DUMMY_CLOCKS = 8,
+		DATA_LANES = 4, CONTINUOUS = 0
+	};
+};
+
+//! Fast Read Dual I/O (0xBB), address, mode and data on two lanes.
+struct SpiFlashReadDualIO {
+	enum {
+		COMMAND = 0xBB, ADDRESS_LANES = 2, MODE_BYTES = 1, DUMMY_CLOCKS = 0,
+		DATA_LANES = 2, CONTINUOUS = 0
+	};
+};
+
+//! Fast Read Quad I/O (0xEB), address, mode and data on four lanes.
+struct SpiFlashReadQuadIO {
+	enum {
+		COMMAND = 0xEB, ADDRESS_LANES = 4, MODE_BYTES = 1, DUMMY_CLOCKS = 4,
+		DATA_LANES = 4, CONTINUOUS = 0
+	};
+};
+
+//! Fast Read Quad I/O (0xEB) in continuous read mode (M7-0 = 0x20). Only the
+//! first read sends the command, later reads start with the address. Any other
+//! command first leaves the mode with a Continuous Read Mode Reset (0xFF).
+struct SpiFlashReadQuadIOContinuous {
+	enum {
+		COMMAND = 0xEB, ADDRESS_LANES = 4, MODE_BYTES = 1, DUMMY_CLOCKS = 4,
+		DATA_LANES = 4, CONTINUOUS = 1
+	};
+};
+
+//! Addressing policies for the Addressing template parameter of SpiFlash.
+//! ADDRESS_BYTES is the address length of every addressed command,
+//! ENTER_4BYTE_MODE makes init() switch the flash to 4-byte address mode and
+//! HAS_BLOCK_ERASE_32K tells whether the 32K block erase can be addressed.
+//! command() maps a 3-byte address opcode to the one actually sent; it is
+//! constexpr, so no opcode is translated at run time.
+
+//! 3-byte addresses, parts up to 16 MB.
+struct SpiFlashAddress3Byte {
+	enum { ADDRESS_BYTES = 3, ENTER_4BYTE_MODE = 0, HAS_BLOCK_ERASE_32K = 1 };
+	static constexpr uint8_t command(uint8_t command) {
+		return command;
+	}
+};
+
+//! 4-byte addresses through the dedicated 4-byte opcodes, the flash stays in
+//! 3-byte address mode. There is no 4-byte opcode for the 32K block erase.
+struct SpiFlashAddress4ByteOpcodes {
+	enum { ADDRESS_BYTES = 4, ENTER_4BYTE_MODE = 0, HAS_BLOCK_ERASE_32K = 0 };
+	static constexpr uint8_t command(uint8_t command) {
+		return
+			(command == 0x02) ? 0x12 : // Page Program.
+			(command == 0x03) ? 0x13 : // Read Data.
+			(command == 0x0B) ? 0x0C : // Fast Read.
+			(command == 0x20) ? 0x21 : // Sector Erase 4K.
+			(command == 0x3B) ? 0x3C : // Fast Read Dual Output.
+			(command == 0x6B) ? 0x6C : // Fast Read Quad Output.
+			(command == 0xBB) ? 0xBC : // Fast Read Dual I/O.
+			(command == 0xD8) ? 0xDC : // Block Erase 64K.
+			(command == 0xEB) ? 0xEC : // Fast Read Quad I/O.
+			command;
+	}
+};
+
+//! 4-byte addresses after Enter 4-Byte Address Mode (0xB7) in init(), all
+//! regular opcodes are kept.
+struct SpiFlashAddress4ByteMode {
+	enum { ADDRESS_BYTES = 4, ENTER_4BYTE_MODE = 1, HAS_BLOCK_ERASE_32K = 1 };
+	static constexpr uint8_t command(uint8_t command) {
+		return command;
+	}
+};
+
+//! Timing descriptors for the Timing template parameter of SpiFlash. typical()
+//! and maximum() return the duration of an operation in microseconds: tPP,
+//! tSE, tBE1 (32K), tBE2 (64K), tCE, tW and tRES1 of the datasheet. Suspend
+//! is tSUS, the time until an erase or program is suspended, Resume the time a
+//! resumed operation must run before it may be suspended again. The maximum
+//! of SpiFlashOperationNone bounds waits for an unknown operation.
+
+//! Winbond W25Q (W25Q128JV figures). Larger parts need a longer tCE.
+struct SpiFlashTimingW25Q {
+	static constexpr uint32_t typical(SpiFlashOperation operation) {
+		return
+			(operation == SpiFlashOperationPageProgram) ? 400ul :
+			(operation == SpiFlashOperationSectorErase) ? 45000ul :
+			(operation == SpiFlashOperationBlockErase32K) ? 120000ul :
+			(operation == SpiFlashOperationBlockErase64K) ? 150000ul :
+			(operation == SpiFlashOperationChipErase) ? 40000000ul :
+			(operation == SpiFlashOperationWriteStatus) ? 10000ul :
+			(operation == SpiFlashOperationReleasePowerDown) ? 3ul :
+			(operation == SpiFlashOperationSuspend) ? 20ul :
+			(operation == SpiFlashOperationResume) ? 20ul :
+			0ul;
+	}
+	static constexpr uint32_t maximum(SpiFlashOperation operation) {
+		return
+			(operation == SpiFlashOperationPageProgram) ? 3000ul :
+			(operation == SpiFlashOperationSectorErase) ? 400000ul :
+			(operation == SpiFlashOperationBlockErase32K) ? 1600000ul :
+			(operation == SpiFlashOperationBlockErase64K) ? 2000000ul :
+			(operation == SpiFlashOperationChipErase) ? 200000000ul :
+			(operation == SpiFlashOperationWriteStatus) ? 15000ul :
+			(operation == SpiFlashOperationReleasePowerDown) ? 3ul :
+			(operation == SpiFlashOperationSuspend) ? 20ul :
+			(operation == SpiFlashOperationResume) ? 20ul :
+			2000000ul;
+	}
+};
+
+//! Monotonic time source of the wait strategies, in microseconds. now() wraps
+//! after about 71 minutes, durations are computed with unsigned arithmetic.
+struct SpiFlashClock {
+	static uint32_t now(void) {
+#ifdef ARDUINO
+		return micros();
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint32_t)ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+#endif
+	}
+	static void sleep(uint32_t us) {
+#ifdef ARDUINO
+		if (us >= 16384) {
+			delay(us / 1000);
+		} else {
+			delayMicroseconds(us);
+		}
+#else
+		struct timespec ts;
+		ts.tv_sec = us / 1000000ul;
+		ts.tv_nsec = (us % 1000000ul) * 1000;
+		nanosleep(&ts, 0);
+#endif
+	}
+	static void yield(void) {
+#ifdef ARDUINO
+		::yield();
+#else
+		sched_yield();
+#endif
+	}
 };
 
-template<typename SpiDevice, uint32_t FLASH_SIZE = 0x7FFFFull /*512k*/>
+//! Wait strategies for the WaitStrategy template parameter of SpiFlash. wait()
+//! calls busy() to poll the status register until it returns false and gives
+//! up with SpiFlashErrorTimeout after timeout microseconds. expected is the
+//! remaining typical duration of the operation, 0 if unknown. getPolls()
+//! counts the status polls of all waits. ClockType is the time source, which
+//! SpiFlash uses as well.
+
+//! Polls the status register back to back, lowest latency.
+template<typename Clock = SpiFlashClock>
+class SpiFlashWaitSpin {
+	uint32_t polls;
+public:
+	typedef Clock ClockType;
+
+	SpiFlashWaitSpin() : polls(0) {
+	}
+	template<typename Busy>
+	int wait(Busy& busy, uint32_t expected, uint32_t timeout) {
+		(void)expected;
+		const uint32_t start = Clock::now();
+		while (polls++, busy()) {
+			if ((Clock::now() - start) > timeout) {
+				return SpiFlashErrorTimeout;
+			}
+		}
+		return SpiFlashErrorSuccess;
+	}
+	uint32_t getPolls(void) const {
+		return polls;
+	}
+	void resetPolls(void) {
+		polls = 0;
+	}
+};
+
+//! Sleeps until shortly before the expected completion, then polls with sleeps
+//! starting at an eighth of the expected duration (at least MIN_SLEEP) and
+//! doubling up to MAX_SLEEP microseconds. Leaves the bus and the core free
+//! during long erases.
+template<typename Clock = SpiFlashClock, uint32_t MIN_SLEEP = 20,
+	uint32_t MAX_SLEEP = 10000>
+class SpiFlashWaitBackoff {
+	uint32_t polls;
+public:
+	typedef Clock ClockType;
+
+	SpiFlashWaitBackoff() : polls(0) {
+	}
+	template<typename Busy>
+	int wait(Busy& busy, uint32_t expected, uint32_t timeout) {
+		const uint32_t start = Clock::now();
+		if (expected > 0 && expected < timeout) {
+			Clock::sleep(expected - expected / 8);
+		}
+		uint32_t pause = expected / 8;
+		pause = (pause < MIN_SLEEP) ? MIN_SLEEP : pause;
+		pause = (pause > MAX_SLEEP) ? MAX_SLEEP : pause;
+		while (polls++, busy()) {
+			const uint32_t elapsed = Clock::now() - start;
+			if (elapsed > timeout) {
+				return SpiFlashErrorTimeout;
+			}
+			// Poll once more right at the timeout.
+			const uint32_t remaining = timeout - elapsed + 1;
+			Clock::sleep((pause < remaining) ? pause : remaining);
+			pause = (pause > MAX_SLEEP / 2) ? MAX_SLEEP : (2 * pause);
+		}
+		return SpiFlashErrorSuccess;
+	}
+	uint32_t getPolls(void) const {
+		return polls;
+	}
+	void resetPolls(void) {
+		polls = 0;
+	}
+};
+
+//! Yields until signal() is called, e.g. from a timer interrupt or another
+//! task that knows the operation is done, and then confirms with a status
+//! poll. Without a signal the status is polled once the timeout expired.
+template<typename Clock = SpiFlashClock>
+class SpiFlashWaitSignal {
+	uint32_t polls;
+	volatile bool signaled;
+public:
+	typedef Clock ClockType;
+
+	SpiFlashWaitSignal() : polls(0), signaled(false) {
+	}
+	//! Reports completion of the current operation.
+	void signal(void) {
+		signaled = true;
+	}
+	template<typename Busy>
+	int wait(Busy& busy, uint32_t expected, uint32_t timeout) {
+		(void)expected;
+		const uint32_t start = Clock::now();
+		while (!signaled && (Clock::now() - start) <= timeout) {
+			Clock::yield();
+		}
+		signaled = false;
+		while (polls++, busy()) {
+			if ((Clock::now() - start) > timeout) {
+				return SpiFlashErrorTimeout;
+			}
+		}
+		return SpiFlashErrorSuccess;
+	}
+	uint32_t getPolls(void) const {
+		return polls;
+	}
+	void resetPolls(void) {
+		polls = 0;
+	}
+};
+
+//! Public operations measured by the Stats template parameter of SpiFlash.
+enum SpiFlashStat {
+	SpiFlashStatRead,
+	SpiFlashStatWrite,
+	SpiFlashStatErase,
+	SpiFlashStatWait,
+	SpiFlashStatGetStatus,
+	SpiFlashStatCount
+};
+
+//! Statistics policies for the Stats template parameter of SpiFlash. begin()
+//! returns the start of a measured operation, end() records its latency,
+//! bytes and result. command() is called per SPI transaction, polled() with
+//! the status polls of a wait, timeout() and wakeup() on a timeout and on a
+//! release from power-down. SpiFlashStats.h provides histograms and counters.
+
+//! Collects nothing, all calls compile away.
+struct SpiFlashStatsNone {
+	uint32_t begin(void) {
+		return 0;
+	}
+	void end(SpiFlashStat, uint32_t, size_t, int) {
+	}
+	void command(void) {
+	}
+	void polled(uint32_t) {
+	}
+	void timeout(void) {
+	}
+	void wakeup(void) {
+	}
+};
+
+//! Default addressing for a flash of FLASH_SIZE: 3-byte up to 16 MB, 4-byte
+//! opcodes above.
+template<uint32_t FLASH_SIZE>
+struct SpiFlashAddressDefault {
+	typedef typename SpiFlashDetail::Conditional<(FLASH_SIZE > 0x1000000ul),
+		SpiFlashAddress4ByteOpcodes, SpiFlashAddress3Byte>::Type Type;
+};
+
+template<typename SpiDevice, uint32_t FLASH_SIZE = 0x7FFFFull /*512k*/,
+	typename ReadMode = SpiFlashReadNormal,
+	typename Addressing = typename SpiFlashAddressDefault<FLASH_SIZE>::Type,
+	typename WaitStrategy = SpiFlashWaitSpin<>,
+	typename Timing = SpiFlashTimingW25Q,
+	typename Stats = SpiFlashStatsNone,
+	size_t SCRATCH_SIZE = 0>
 class SpiFlash {
 
 	enum {
 		CMD_WRITE_STATUS_REGISTER = 0x01,
 		CMD_PAGE_PROGRAM = 0x02,
-		CMD_READ_DATA = 0x03,
 		CMD_READ_STATUS_REGISTER = 0x05,
 		CMD_WRITE_ENABLE = 0x06,
 		CMD_SECTOR_ERASE_4K = 0x20,
+		CMD_READ_STATUS_REGISTER_2 = 0x35,
 		CMD_READ_UNIQUE_ID = 0x4B,
 		CMD_BLOCK_ERASE_32K = 0x52,
+		CMD_ERASE_PROGRAM_SUSPEND = 0x75,
+		CMD_ERASE_PROGRAM_RESUME = 0x7A,
+		CMD_ENTER_4BYTE_ADDRESS_MODE = 0xB7,
+		CMD_BLOCK_ERASE_64K = 0xD8,
+		CMD_CHIP_ERASE = 0xC7,
 		CMD_RELEASE_POWER_DOWN = 0xAB,
 		CMD_POWER_DOWN = 0xB9,
 		CMD_JEDEC_ID = 0x9F,
 		REG_STATUS_REGISTER_BUSY = (1 << 0),
+		REG_STATUS_REGISTER_2_QE = (1 << 1),
+		CMD_CONTINUOUS_READ_MODE_RESET = 0xFF,
+		MODE_CONTINUOUS_READ = 0x20,
+		MODE_NORMAL_READ = 0x00,
 	};
 
+	//! Operations run by poll().
+	enum {
+		JOB_NONE,
+		JOB_ERASE,
+		JOB_WRITE,
+		JOB_SET_STATUS
+	};
+
+	//! Read paths, chosen at compile time from ReadMode and SpiDevice.
+	enum {
+		READ_PATH_BULK,
+		READ_PATH_SPLIT,
+		READ_PATH_LANES
+	};
+	enum {
+		IS_MULTI_LANE = (ReadMode::ADDRESS_LANES > 1) ||
+			(ReadMode::DATA_LANES > 1),
+		USE_LANES = IS_MULTI_LANE &&
+			SpiFlashDetail::HasTransferLanes<SpiDevice>::value,
+		USE_CONTINUOUS = USE_LANES && ReadMode::CONTINUOUS,
+		USE_QUAD = USE_LANES &&
+			((ReadMode::ADDRESS_LANES == 4) || (ReadMode::DATA_LANES == 4)),
+		READ_PATH = USE_LANES ? READ_PATH_LANES :
+			(SpiFlashDetail::HasTransferIn<SpiDevice>::value ?
+				READ_PATH_SPLIT : READ_PATH_BULK)
+	};
+	enum {
+		ADDRESS_BYTES = Addressing::ADDRESS_BYTES,
+		//! Command + address.
+		HEADER_SIZE = 1 + ADDRESS_BYTES
+	};
+	//! Single lane read command, Fast Read if ReadMode can not be used.
+	typedef typename SpiFlashDetail::Conditional<IS_MULTI_LANE,
+		SpiFlashReadFast, ReadMode>::Type SingleLaneReadMode;
+	typedef typename WaitStrategy::ClockType Clock;
+
 	SpiDevice spi;
+	WaitStrategy waiter;
+	Stats statistics;
 	bool isPoweredDown;
+	//! Flash is in continuous read mode, the next read omits the command.
+	bool isContinuousReadArmed;
+	//! Operation the flash may still be busy with and when it was issued.
+	SpiFlashOperation inFlight;
+	uint32_t inFlightStart;
+	//! Since when the operation in flight runs without being suspended and
+	//! when it was suspended last.
+	uint32_t runningSince;
+	uint32_t suspendedAt;
+	//! Operation run by poll(), bytes counts what is left to issue.
+	struct Job {
+		uint8_t type;
+		SpiFlashHandle handle;
+		const uint8_t* data;
+		uint32_t offset;
+		size_t bytes;
+		//! Range changed by the command in flight.
+		uint32_t unitOffset;
+		size_t unitSize;
+		bool chip;
+		uint8_t value;
+		uint8_t* buffer;
+	} job;
+	SpiFlashHandle nextHandle;
+	SpiFlashHandle lastHandle;
+	int lastResult;
+	SpiFlashCallback callback;
+	void* callbackContext;
+	//! Transfer buffers if SCRATCH_SIZE is given, see acquire().
+	uint8_t scratch[SCRATCH_SIZE ? SCRATCH_SIZE : 1];
+
+	//! The SpiDevice for one transaction, counted as a command.
+	SpiDevice& bus(void) {
+		statistics.command();
+		return spi;
+	}
 
 	void recoverFromPowerDown(void) {
 		if (isPoweredDown) {
-			spi.transfer(CMD_RELEASE_POWER_DOWN);
+			statistics.wakeup();
+			bus().transfer(CMD_RELEASE_POWER_DOWN);
+			Clock::sleep(Timing::maximum(SpiFlashOperationReleasePowerDown));
 			isPoweredDown = false;
 		}
 	}
 
+	//! Records an operation the flash is now busy with.
+	void started(SpiFlashOperation operation) {
+		inFlight = operation;
+		inFlightStart = Clock::now();
+		runningSince = inFlightStart;
+	}
+
+	//! Suspends the erase or page program in flight so that [offset,
+	//! offset + bytes) can be read. The range changed by the operation can not
+	//! be read, nor can chip erases and status writes be suspended.
+	//! \param suspended Set if a resume() is needed after the read.
+	//! \returns SpiFlashErrorSuccess if the range can be read or
+	//! SpiFlashErrorBusy otherwise.
+	int suspend(uint32_t offset, size_t bytes, bool& suspended) {
+		suspended = false;
+		if (inFlight == SpiFlashOperationNone) {
+			return SpiFlashErrorSuccess;
+		}
+		if (!(getStatus() & REG_STATUS_REGISTER_BUSY)) {
+			// Done, poll() will issue the next command.
+			return SpiFlashErrorSuccess;
+		}
+		if (inFlight != SpiFlashOperationPageProgram &&
+				inFlight != SpiFlashOperationSectorErase &&
+				inFlight != SpiFlashOperationBlockErase32K &&
+				inFlight != SpiFlashOperationBlockErase64K) {
+			return SpiFlashErrorBusy;
+		}
+		if (offset < job.unitOffset + job.unitSize &&
+				job.unitOffset < offset + bytes) {
+			return SpiFlashErrorBusy;
+		}
+		// Let the operation progress for the minimum resume to suspend time.
+		const uint32_t running = Clock::now() - runningSince;
+		const uint32_t interval = Timing::typical(SpiFlashOperationResume);
+		if (running < interval) {
+			Clock::sleep(interval - running);
+		}
+		bus().transfer(CMD_ERASE_PROGRAM_SUSPEND);
+		suspended = true;
+		suspendedAt = Clock::now();
+		while (getStatus() & REG_STATUS_REGISTER_BUSY) {
+			if ((Clock::now() - suspendedAt) >
+					Timing::maximum(SpiFlashOperationSuspend)) {
+				resume();
+				suspended = false;
+				return SpiFlashErrorBusy;
+			}
+		}
+		return SpiFlashErrorSuccess;
+	}
+
+	//! Resumes the operation suspended by suspend(). The time spent suspended
+	//! does not count towards its timeout.
+	void resume(void) {
+		// The read may have left continuous read mode armed.
+		prepareCommand();
+		bus().transfer(CMD_ERASE_PROGRAM_RESUME);
+		const uint32_t now = Clock::now();
+		inFlightStart += now - suspendedAt;
+		runningSince = now;
+	}
+
+	//! Leaves continuous read mode so the flash decodes commands again. Dual
+	//! I/O needs 16 clocks of 0xFF, quad I/O 8 clocks.
+	void resetContinuousRead(void) {
+		for (int i = 0; i < ((ReadMode::ADDRESS_LANES == 2) ? 2 : 1); i++) {
+			bus().transfer(CMD_CONTINUOUS_READ_MODE_RESET);
+		}
+		isContinuousReadArmed = false;
+	}
+
+	//! Brings the flash into a state where it accepts any command.
+	void prepareCommand(void) {
+		recoverFromPowerDown();
+		if (USE_CONTINUOUS && isContinuousReadArmed) {
+			resetContinuousRead();
+		}
+	}
+
+	//! Status poll handed to the WaitStrategy.
+	class Busy {
+		SpiFlash& flash;
+	public:
+		explicit Busy(SpiFlash& flash) : flash(flash) {
+		}
+		bool operator()(void) {
+			return flash.getStatus() & REG_STATUS_REGISTER_BUSY;
+		}
+	};
+
 	//! Set the write enable latch.
 	void writeEnable(void) {
-		spi.transfer(CMD_WRITE_ENABLE);
+		bus().transfer(CMD_WRITE_ENABLE);
+	}
+
+	//! Starts the erase of a block of SPI flash.
+	void issueErase(uint32_t offset, uint8_t block) {
+		//Enable writing to SPI Flash.
+		writeEnable();
+		uint8_t bytes[HEADER_SIZE];
+		buildHeader(bytes,
+			(block == 4) ? CMD_SECTOR_ERASE_4K :
+			(block == 32) ? CMD_BLOCK_ERASE_32K : CMD_BLOCK_ERASE_64K, offset);
+		bus().transferBulk(bytes, sizeof(bytes));
+		started((block == 4) ? SpiFlashOperationSectorErase :
+			(block == 32) ? SpiFlashOperationBlockErase32K :
+			SpiFlashOperationBlockErase64K);
 	}
 
 	//! Erase a block of SPI flash.
-	void eraseBlock(uint32_t offset, uint8_t block) {
+	int eraseBlock(uint32_t offset, uint8_t block) {
 		// Invalid block size.
-		if (block != 4 && block != 32)
+		if (block != 4 && block != 32 && block != 64)
+			return SpiFlashErrorInputValue;
+		if (block == 32 && !Addressing::HAS_BLOCK_ERASE_32K)
 			return SpiFlashErrorInputValue;
 		// Not block aligned.
-		if ((offset % (block * 1024)) != 0)
+		if ((offset % (block * 1024ul)) != 0)
 			return SpiFlashErrorInputValue;
-		//Enable writing to SPI Flash.
-		int result = writeEnable();
-		if (result) {
-			return result;
+		issueErase(offset, block);
+		// Wait for previous operation to complete.
+		return wait();
+	}
+
+	//! Starts the erase of the whole flash.
+	void issueChipErase(void) {
+		writeEnable();
+		bus().transfer(CMD_CHIP_ERASE);
+		started(SpiFlashOperationChipErase);
+	}
+
+	//! Length of the next page program: it can not go beyond the end of the
+	//! flash page.
+	static size_t pageFragment(uint32_t offset, size_t bytes) {
+		const size_t writeSize = 256 - (offset & 0xFF);
+		return (bytes <= writeSize) ? bytes : writeSize;
+	}
+
+	//! Assembles the page program of size bytes of data at offset, within
+	//! one page.
+	//! \param buffer Header + page sized transfer buffer.
+	//! \returns Transaction length.
+	static size_t buildPageProgram(uint8_t* buffer, const uint8_t* data,
+			uint32_t offset, size_t size) {
+		const size_t headerLength =
+			buildHeader(buffer, CMD_PAGE_PROGRAM, offset);
+		memcpy(&buffer[headerLength], data, size);
+		return headerLength + size;
+	}
+
+	//! Starts an assembled page program of size bytes at offset. Leading and
+	//! trailing 0xFF bytes are dropped, programming them changes nothing, and
+	//! the header is rebuilt in front of the first byte left. A payload of
+	//! only 0xFF bytes is not sent at all.
+	//! \param buffer Header + page as built by buildPageProgram().
+	void sendPageProgram(uint8_t* buffer, uint32_t offset, size_t size) {
+		uint8_t* payload = &buffer[HEADER_SIZE];
+		const size_t first = SpiFlashDetail::erasedPrefix(payload, size);
+		if (first == size) {
+			return;
 		}
-		uint8_t bytes[] = {
-			((block == 4) ? CMD_SECTOR_ERASE_4K : CMD_BLOCK_ERASE_32K),
-			((offset >> 16) & 0xFF),
-			((offset >> 8) & 0xFF),
-			(offset & 0xFF)
+		const size_t last =
+			size - SpiFlashDetail::erasedSuffix(&payload[first], size - first);
+		// The header takes the place of dropped bytes.
+		uint8_t* transaction = &payload[first - HEADER_SIZE];
+		buildHeader(transaction, CMD_PAGE_PROGRAM, offset + first);
+		// Enable writing to SPI flash.
+		writeEnable();
+		bus().transferBulk(transaction, HEADER_SIZE + last - first);
+		started(SpiFlashOperationPageProgram);
+	}
+
+	//! Starts programming size bytes of data at offset, within one page.
+	//! \param buffer Header + page sized transfer buffer.
+	void issuePageProgram(uint8_t* buffer, const uint8_t* data,
+			uint32_t offset, size_t size) {
+		buildPageProgram(buffer, data, offset, size);
+		sendPageProgram(buffer, offset, size);
+	}
+
+	//! Starts a status register write.
+	void issueSetStatus(uint8_t registerValue) {
+		writeEnable();
+		bus().transferRegister(CMD_WRITE_STATUS_REGISTER, registerValue);
+		started(SpiFlashOperationWriteStatus);
+	}
+
+	//! Sets up job and hands out its handle.
+	void startJob(uint8_t type, uint32_t offset, size_t bytes,
+			SpiFlashHandle* handle) {
+		job.type = type;
+		job.handle = nextHandle++;
+		if (nextHandle == 0) {
+			nextHandle = 1;
+		}
+		job.data = 0;
+		job.offset = offset;
+		job.bytes = bytes;
+		job.unitOffset = 0;
+		job.unitSize = 0;
+		job.chip = false;
+		job.value = 0;
+		job.buffer = 0;
+		if (handle) {
+			*handle = job.handle;
+		}
+	}
+
+	//! Issues the next command of job once the flash is idle.
+	//! \returns false if nothing is left to issue.
+	bool issueJob(void) {
+		if (job.bytes == 0) {
+			return false;
+		}
+		switch (job.type) {
+		case JOB_ERASE:
+			if (job.chip) {
+				issueChipErase();
+				job.unitOffset = 0;
+				job.unitSize = CAPACITY;
+				job.bytes = 0;
+			} else {
+				const uint8_t unit = eraseUnit(job.offset, job.bytes);
+				issueErase(job.offset, unit);
+				job.unitOffset = job.offset;
+				job.unitSize = unit * 1024ul;
+				job.offset += unit * 1024ul;
+				job.bytes -= unit * 1024ul;
+			}
+			return true;
+		case JOB_WRITE: {
+			const size_t writeSize = pageFragment(job.offset, job.bytes);
+			issuePageProgram(job.buffer, job.data, job.offset, writeSize);
+			job.unitOffset = job.offset;
+			job.unitSize = writeSize;
+			job.data += writeSize;
+			job.offset += writeSize;
+			job.bytes -= writeSize;
+			return true;
+		}
+		case JOB_SET_STATUS:
+			issueSetStatus(job.value);
+			job.bytes = 0;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	//! Completes job and reports result.
+	int finishJob(int result) {
+		release(job.buffer);
+		job.buffer = 0;
+		job.type = JOB_NONE;
+		lastHandle = job.handle;
+		lastResult = result;
+		if (callback) {
+			callback(lastHandle, result, callbackContext);
+		}
+		return result;
+	}
+
+	//! Largest payload clocked per read command on devices without
+	//! transferIn(), bounding the size of the full-duplex buffer.
+	enum { READ_CHUNK_SIZE = 256 };
+	//! Command + address + dummy bytes of a read.
+	enum {
+		READ_HEADER_SIZE = HEADER_SIZE + SingleLaneReadMode::DUMMY_CLOCKS / 8
+	};
+
+	//! Regions of scratch. Buffers in use at the same time have regions of
+	//! their own: a write job keeps the page buffer while read() streams
+	//! through the read buffer, a verification or blank check reads into the
+	//! check buffer through the read buffer, update() needs all but the check
+	//! buffer.
+	enum {
+		//! Page program: header + page.
+		PAGE_BUFFER = 0,
+		PAGE_BUFFER_SIZE = HEADER_SIZE + 256,
+		//! Full-duplex read chunk, only used without transferIn().
+		READ_BUFFER = PAGE_BUFFER + PAGE_BUFFER_SIZE,
+		READ_BUFFER_SIZE =
+			(static_cast<int>(READ_PATH) == static_cast<int>(READ_PATH_BULK)) ?
+			(READ_HEADER_SIZE + READ_CHUNK_SIZE) : 0,
+		//! Page read back by a verification or blank check.
+		CHECK_BUFFER = READ_BUFFER + READ_BUFFER_SIZE,
+		CHECK_BUFFER_SIZE = 256,
+		//! Sector rewritten by update().
+		SECTOR_BUFFER = CHECK_BUFFER + CHECK_BUFFER_SIZE,
+		SECTOR_BUFFER_SIZE = 4096
+	};
+
+public:
+	//! Least SCRATCH_SIZE for read(), write() and erase(), and for update().
+	enum {
+		MIN_SCRATCH_SIZE = SECTOR_BUFFER,
+		UPDATE_SCRATCH_SIZE = SECTOR_BUFFER + SECTOR_BUFFER_SIZE
+	};
+
+private:
+	static_assert(SCRATCH_SIZE == 0 || SCRATCH_SIZE >= MIN_SCRATCH_SIZE,
+		"SCRATCH_SIZE must be 0 or at least MIN_SCRATCH_SIZE");
+
+	//! Returns the region of scratch for a buffer of size bytes or, without
+	//! SCRATCH_SIZE, allocates it.
+	uint8_t* acquire(size_t region, size_t size) {
+		return SCRATCH_SIZE ? &scratch[region] : new uint8_t[size];
+	}
+
+	//! Gives back a buffer from acquire().
+	void release(uint8_t* buffer) {
+		if (!SCRATCH_SIZE) {
+			delete[] buffer;
+		}
+	}
+
+	//! Checks that [offset, offset + bytes) lies inside the flash. The
+	//! offset is compared as uint32_t, size_t may be 16 bit.
+	static bool isOutOfRange(uint32_t offset, size_t bytes) {
+		return (bytes > CAPACITY) ||
+			(offset > (CAPACITY - static_cast<uint32_t>(bytes)));
+	}
+
+	//! Typical durations of the erase units in microseconds. The 32K block
+	//! erase is used only if it is available and cheaper than eight sector
+	//! erases, the 64K block erase only if cheaper than the best way to erase
+	//! two 32K blocks. As the units nest, this per unit choice gives the
+	//! cheapest cover of any sector aligned range.
+	enum {
+		ERASE_4K_US = Timing::typical(SpiFlashOperationSectorErase),
+		ERASE_32K_US = Timing::typical(SpiFlashOperationBlockErase32K),
+		ERASE_64K_US = Timing::typical(SpiFlashOperationBlockErase64K),
+		USE_ERASE_32K = Addressing::HAS_BLOCK_ERASE_32K &&
+			(ERASE_32K_US < 8ul * ERASE_4K_US),
+		BEST_32K_US = USE_ERASE_32K ? ERASE_32K_US : (8ul * ERASE_4K_US),
+		USE_ERASE_64K = (ERASE_64K_US < 2ul * BEST_32K_US)
+	};
+
+	//! Largest erase unit in KB to use at offset for the remaining bytes.
+	static uint8_t eraseUnit(uint32_t offset, size_t bytes) {
+		if (USE_ERASE_64K && (offset % 65536ul) == 0 && bytes >= 65536ul) {
+			return 64;
+		}
+		if (USE_ERASE_32K && (offset % 32768ul) == 0 && bytes >= 32768ul) {
+			return 32;
+		}
+		return 4;
+	}
+
+	//! Erases the whole flash.
+	int eraseChip(void) {
+		issueChipErase();
+		return wait();
+	}
+
+	//! Erases a sector aligned range as planned by planErase().
+	int erasePlanned(uint32_t offset, size_t bytes,
+			const SpiFlashErasePlan& plan) {
+		if (plan.chip) {
+			return eraseChip();
+		}
+		while (bytes > 0) {
+			const uint8_t unit = eraseUnit(offset, bytes);
+			int result = eraseBlock(offset, unit);
+			if (result) {
+				return result;
+			}
+			bytes -= unit * 1024ul;
+			offset += unit * 1024ul;
+		}
+		return SpiFlashErrorSuccess;
+	}
+
+	//! Whether the sector at offset reads all 0xFF, stops at the first chunk
+	//! holding programmed bits.
+	bool isSectorBlank(uint32_t offset, uint8_t* buffer) {
+		for (size_t i = 0; i < 4096; i += READ_CHUNK_SIZE) {
+			readBulk(buffer, offset + i, READ_CHUNK_SIZE,
+				SpiFlashDetail::Int<READ_PATH>());
+			if (!SpiFlashDetail::isErased(buffer, READ_CHUNK_SIZE)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//! Erases a run of sectors found not blank and adds its erases to plan.
+	int eraseRun(uint32_t offset, size_t bytes, SpiFlashErasePlan& plan) {
+		SpiFlashErasePlan run;
+		planErase(offset, bytes, run);
+		plan.sectors += run.sectors;
+		plan.blocks32K += run.blocks32K;
+		plan.blocks64K += run.blocks64K;
+		plan.chip = run.chip;
+		plan.typicalMs += run.typicalMs;
+		// The blank check may have left continuous read mode armed.
+		prepareCommand();
+		return erasePlanned(offset, bytes, run);
+	}
+
+	//! Erases the sectors of a range that are not blank. Runs of consecutive
+	//! sectors to erase are planned like a range of their own.
+	int eraseDirty(uint32_t offset, size_t bytes, SpiFlashErasePlan& plan) {
+		plan.sectors = 0;
+		plan.blocks32K = 0;
+		plan.blocks64K = 0;
+		plan.chip = false;
+		plan.typicalMs = 0;
+		plan.skipped = 0;
+		uint8_t* buffer = acquire(CHECK_BUFFER, CHECK_BUFFER_SIZE);
+		uint32_t run = offset;
+		size_t runBytes = 0;
+		int result = SpiFlashErrorSuccess;
+		for (; bytes > 0 && !result; offset += 4096, bytes -= 4096) {
+			if (!isSectorBlank(offset, buffer)) {
+				if (runBytes == 0) {
+					run = offset;
+				}
+				runBytes += 4096;
+				continue;
+			}
+			plan.skipped++;
+			if (runBytes > 0) {
+				result = eraseRun(run, runBytes, plan);
+				runBytes = 0;
+			}
+		}
+		if (!result && runBytes > 0) {
+			result = eraseRun(run, runBytes, plan);
+		}
+		release(buffer);
+		return result;
+	}
+
+	//! Fills in the address bytes of a transaction, MSB first.
+	//! \returns Address length.
+	static size_t buildAddress(uint8_t* address, uint32_t offset) {
+		for (size_t i = 0; i < ADDRESS_BYTES; i++) {
+			address[i] = (offset >> (8 * (ADDRESS_BYTES - 1 - i))) & 0xFF;
+		}
+		return ADDRESS_BYTES;
+	}
+
+	//! Fills in command + address of a transaction header. The command is
+	//! given as its 3-byte address opcode.
+	//! \returns Header length.
+	static size_t buildHeader(uint8_t* header, uint8_t command,
+			uint32_t offset) {
+		header[0] = Addressing::command(command);
+		return 1 + buildAddress(&header[1], offset);
+	}
+
+	//! Fills in the read command, address and dummy bytes of a single lane
+	//! read.
+	//! \returns Header length.
+	static size_t buildReadHeader(uint8_t* header, uint32_t offset) {
+		size_t length =
+			buildHeader(header, SingleLaneReadMode::COMMAND, offset);
+		for (size_t i = 0; i < SingleLaneReadMode::DUMMY_CLOCKS / 8; i++) {
+			header[length++] = 0x00;
+		}
+		return length;
+	}
+
+	//! Multi-lane read: a single ReadMode transaction of any length through
+	//! transferLanes().
+	void readBulk(uint8_t* data, uint32_t offset, size_t bytes,
+			SpiFlashDetail::Int<READ_PATH_LANES>) {
+		uint8_t address[ADDRESS_BYTES + ReadMode::MODE_BYTES];
+		size_t addressLength = buildAddress(address, offset);
+		for (size_t i = 0; i < ReadMode::MODE_BYTES; i++) {
+			address[addressLength++] =
+				USE_CONTINUOUS ? MODE_CONTINUOUS_READ : MODE_NORMAL_READ;
+		}
+		SpiFlashLaneTransfer transfer;
+		transfer.command = Addressing::command(ReadMode::COMMAND);
+		transfer.skipCommand = USE_CONTINUOUS && isContinuousReadArmed;
+		transfer.address = address;
+		transfer.addressLength = addressLength;
+		transfer.addressLanes = ReadMode::ADDRESS_LANES;
+		transfer.dummyClocks = ReadMode::DUMMY_CLOCKS;
+		transfer.data = data;
+		transfer.length = bytes;
+		transfer.dataLanes = ReadMode::DATA_LANES;
+		bus().transferLanes(transfer);
+		isContinuousReadArmed = USE_CONTINUOUS;
+	}
+
+	//! Split-phase read: a single read transaction of any length with the
+	//! payload clocked straight into the caller buffer.
+	void readBulk(uint8_t* data, uint32_t offset, size_t bytes,
+			SpiFlashDetail::Int<READ_PATH_SPLIT>) {
+		uint8_t header[READ_HEADER_SIZE];
+		const size_t headerLength = buildReadHeader(header, offset);
+		bus().transferIn(header, headerLength, data, bytes);
+	}
+
+	//! Full-duplex fallback for devices without transferIn(), streamed in
+	//! chunks of READ_CHUNK_SIZE through one reused buffer.
+	void readBulk(uint8_t* data, uint32_t offset, size_t bytes,
+			SpiFlashDetail::Int<READ_PATH_BULK>) {
+		const size_t chunk = (bytes < static_cast<size_t>(READ_CHUNK_SIZE)) ?
+			bytes : static_cast<size_t>(READ_CHUNK_SIZE);
+		uint8_t* buffer = acquire(READ_BUFFER, READ_HEADER_SIZE + chunk);
+		while (bytes > 0) {
+			const size_t readSize = (bytes < chunk) ? bytes : chunk;
+			const size_t headerLength = buildReadHeader(buffer, offset);
+			const size_t length = headerLength + readSize;
+			for (size_t i = headerLength; i < length; i++) {
+				buffer[i] = 0x00;
+			}
+			bus().transferBulk(buffer, length);
+			memcpy(data, &buffer[headerLength], readSize);
+			data += readSize;
+			offset += readSize;
+			bytes -= readSize;
+		}
+		release(buffer);
+	}
+
+	//! Sets the QE bit needed by the quad read modes.
+	int enableQuad(SpiFlashDetail::Bool<true>) {
+		const uint8_t status2 = getStatus2();
+		if (status2 & REG_STATUS_REGISTER_2_QE) {
+			return SpiFlashErrorSuccess;
+		}
+		// Status register 1 and 2 are written together.
+		uint8_t buffer[] = {
+			CMD_WRITE_STATUS_REGISTER,
+			getStatus(),
+			static_cast<uint8_t>(status2 | REG_STATUS_REGISTER_2_QE)
 		};
-		spi.transferBulk(bytes, sizeof(bytes));
-		// Wait for previous operation to complete.
+		writeEnable();
+		bus().transferBulk(buffer, sizeof(buffer));
+		started(SpiFlashOperationWriteStatus);
 		return wait();
 	}
 
+	int enableQuad(SpiFlashDetail::Bool<false>) {
+		return SpiFlashErrorSuccess;
+	}
+
+	//! read() without statistics.
+	int readData(uint8_t* data, uint32_t offset, size_t bytes) {
+		if (!data || isOutOfRange(offset, bytes)) {
+			return SpiFlashErrorInputValue;
+		}
+		if (bytes == 0) {
+			return SpiFlashErrorSuccess;
+		}
+		bool suspended = false;
+		if (job.type != JOB_NONE) {
+			int result = suspend(offset, bytes, suspended);
+			if (result) {
+				return result;
+			}
+		}
+		recoverFromPowerDown();
+		readBulk(data, offset, bytes, SpiFlashDetail::Int<READ_PATH>());
+		if (suspended) {
+			resume();
+		}
+		return SpiFlashErrorSuccess;
+	}
+
+	//! erase() without statistics.
+	int eraseRange(uint32_t offset, size_t bytes, SpiFlashErasePlan* plan,
+			SpiFlashEraseMode mode) {
+		SpiFlashErasePlan chosen;
+		int result = planErase(offset, bytes, chosen);
+		if (!result && job.type != JOB_NONE) {
+			result = SpiFlashErrorBusy;
+		}
+		if (!result) {
+			prepareCommand();
+			result = (mode == SpiFlashEraseBlankCheck) ?
+				eraseDirty(offset, bytes, chosen) :
+				erasePlanned(offset, bytes, chosen);
+		}
+		if (plan) {
+			*plan = chosen;
+		}
+		return result;
+	}
+
+	//! Page programs issued again after a failed verification.
+	enum { VERIFY_RETRIES = 1 };
+
+	//! Assembles the page program of size bytes of data at offset and
+	//! applies transform to the payload.
+	static void preparePage(uint8_t* buffer, const uint8_t* data,
+			uint32_t offset, size_t size, SpiFlashPageTransform transform,
+			void* context) {
+		buildPageProgram(buffer, data, offset, size);
+		if (transform) {
+			transform(&buffer[HEADER_SIZE], size, offset, context);
+		}
+	}
+
+	//! Reads back size bytes at offset and compares their CRC-32C with crc.
+	//! \param readback Page sized buffer.
+	//! \returns SpiFlashErrorSuccess or SpiFlashErrorVerify on a mismatch.
+	int verifyPage(uint8_t* readback, uint32_t offset, size_t size,
+			uint32_t crc) {
+		readBulk(readback, offset, size, SpiFlashDetail::Int<READ_PATH>());
+		// Leave continuous read mode for the next page program.
+		prepareCommand();
+		return (SpiFlashDetail::crc32c(0, readback, size) == crc) ?
+			SpiFlashErrorSuccess : SpiFlashErrorVerify;
+	}
+
+	//! write() without statistics. Pipelined: each page program is
+	//! assembled (and transformed) while the previous one is still busy and
+	//! sent as soon as the flash is idle. When verifying, the CRC of the
+	//! payload is computed at the same time, so only the CRC of a page has
+	//! to be kept until it is read back, not the page.
+	int writeData(const uint8_t* data, uint32_t offset, size_t bytes,
+			SpiFlashPageTransform transform, void* context,
+			SpiFlashWriteMode mode, uint32_t* failed) {
+		if (!data || isOutOfRange(offset, bytes)) {
+			return SpiFlashErrorInputValue;
+		}
+		if (job.type != JOB_NONE) {
+			return SpiFlashErrorBusy;
+		}
+		if (bytes == 0) {
+			return SpiFlashErrorSuccess;
+		}
+		prepareCommand();
+		const bool verify = (mode == SpiFlashWriteVerify);
+		// One page buffer serves all page programs of this call: the
+		// transfer of a page completes before the next one is assembled.
+		uint8_t* buffer = acquire(PAGE_BUFFER, PAGE_BUFFER_SIZE);
+		uint8_t* readback =
+			verify ? acquire(CHECK_BUFFER, CHECK_BUFFER_SIZE) : 0;
+		size_t writeSize = pageFragment(offset, bytes);
+		preparePage(buffer, data, offset, writeSize, transform, context);
+		uint32_t crc = verify ?
+			SpiFlashDetail::crc32c(0, &buffer[HEADER_SIZE], writeSize) : 0;
+		uint8_t retries = 0;
+		int result;
+		while (true) {
+			// Wait for previous operation to complete.
+			result = wait();
+			if (result) {
+				break;
+			}
+			sendPageProgram(buffer, offset, writeSize);
+			const uint32_t sentOffset = offset;
+			const size_t sentSize = writeSize;
+			const uint32_t sentCrc = crc;
+			data += writeSize;
+			offset += writeSize;
+			bytes -= writeSize;
+			if (bytes > 0) {
+				writeSize = pageFragment(offset, bytes);
+				preparePage(buffer, data, offset, writeSize, transform,
+					context);
+				if (verify) {
+					crc = SpiFlashDetail::crc32c(0, &buffer[HEADER_SIZE],
+						writeSize);
+				}
+			}
+			if (verify) {
+				result = wait();
+				if (!result) {
+					result = verifyPage(readback, sentOffset, sentSize,
+						sentCrc);
+				}
+				if (result == SpiFlashErrorVerify &&
+						retries < VERIFY_RETRIES) {
+					// Program the page again, NOR programming can still
+					// clear bits left set.
+					retries++;
+					data -= sentSize;
+					offset = sentOffset;
+					bytes += sentSize;
+					writeSize = sentSize;
+					preparePage(buffer, data, offset, writeSize, transform,
+						context);
+					crc = sentCrc;
+					continue;
+				}
+				if (result) {
+					if (failed && result == SpiFlashErrorVerify) {
+						*failed = sentOffset;
+					}
+					break;
+				}
+				retries = 0;
+			}
+			if (bytes == 0) {
+				// Wait for the last page to complete.
+				result = wait();
+				break;
+			}
+		}
+		release(readback);
+		release(buffer);
+		return result;
+	}
+
+	//! Rewrites the sector holding [offset, offset + bytes) with data merged
+	//! in: read, erase and program of the pages that are not blank.
+	//! \param buffer Header + page sized transfer buffer.
+	//! \param sector Sector buffer, acquired on first use.
+	int rewriteSector(const uint8_t* data, uint32_t offset, size_t bytes,
+			uint8_t* buffer, uint8_t*& sector) {
+		const uint32_t base = offset & ~0xFFFul;
+		if (!sector) {
+			sector = acquire(SECTOR_BUFFER, SECTOR_BUFFER_SIZE);
+		}
+		int result = wait();
+		if (result) {
+			return result;
+		}
+		readBulk(sector, base, 4096, SpiFlashDetail::Int<READ_PATH>());
+		memcpy(&sector[offset - base], data, bytes);
+		prepareCommand();
+		result = eraseBlock(base, 4);
+		for (size_t page = 0; page < 4096 && !result; page += 256) {
+			if (SpiFlashDetail::isErased(&sector[page], 256)) {
+				continue;
+			}
+			issuePageProgram(buffer, &sector[page], base + page, 256);
+			result = wait();
+		}
+		return result;
+	}
+
+	//! Updates [offset, offset + bytes) within one sector. Pages that match
+	//! are skipped, changes that only clear bits are programmed in place, any
+	//! bit to set rewrites the sector.
+	int updateSector(const uint8_t* data, uint32_t offset, size_t bytes,
+			uint8_t* buffer, uint8_t*& sector) {
+		// The page part of the transfer buffer receives the current contents.
+		uint8_t* current = &buffer[HEADER_SIZE];
+		for (size_t done = 0; done < bytes; ) {
+			const size_t size = pageFragment(offset + done, bytes - done);
+			const uint8_t* wanted = &data[done];
+			int result = wait();
+			if (result) {
+				return result;
+			}
+			readBulk(current, offset + done, size,
+				SpiFlashDetail::Int<READ_PATH>());
+			size_t first = 0;
+			while (first < size && current[first] == wanted[first]) {
+				first++;
+			}
+			if (first == size) {
+				done += size;
+				continue;
+			}
+			size_t last = size;
+			while (current[last - 1] == wanted[last - 1]) {
+				last--;
+			}
+			for (size_t i = first; i < last; i++) {
+				// NOR programming can only clear bits.
+				if ((current[i] & wanted[i]) != wanted[i]) {
+					return rewriteSector(data, offset, bytes, buffer, sector);
+				}
+			}
+			prepareCommand();
+			issuePageProgram(buffer, &wanted[first], offset + done + first,
+				last - first);
+			done += size;
+		}
+		return SpiFlashErrorSuccess;
+	}
+
+	//! update() without statistics.
+	int updateData(const uint8_t* data, uint32_t offset, size_t bytes) {
+		if (!data || isOutOfRange(offset, bytes)) {
+			return SpiFlashErrorInputValue;
+		}
+		if (job.type != JOB_NONE) {
+			return SpiFlashErrorBusy;
+		}
+		if (bytes == 0) {
+			return SpiFlashErrorSuccess;
+		}
+		prepareCommand();
+		uint8_t* buffer = acquire(PAGE_BUFFER, PAGE_BUFFER_SIZE);
+		uint8_t* sector = 0;
+		int result = SpiFlashErrorSuccess;
+		while (bytes > 0 && !result) {
+			const size_t sectorSize = 4096 - (offset & 0xFFF);
+			const size_t size = (bytes < sectorSize) ? bytes : sectorSize;
+			result = updateSector(data, offset, size, buffer, sector);
+			data += size;
+			offset += size;
+			bytes -= size;
+		}
+		release(sector);
+		release(buffer);
+		return result ? result : wait();
+	}
+
 public:
-	void init(void) {
+	//! Flash size in bytes. FLASH_SIZE may be given as the size or as the
+	//! last address, both round up to the same sector multiple.
+	static const uint32_t CAPACITY = (FLASH_SIZE + 0xFFFul) & ~0xFFFul;
+
+	SpiFlash() : isPoweredDown(false), isContinuousReadArmed(false),
+			inFlight(SpiFlashOperationNone), inFlightStart(0), runningSince(0),
+			suspendedAt(0), nextHandle(1),
+			lastHandle(0), lastResult(SpiFlashErrorSuccess), callback(0),
+			callbackContext(0) {
+		job.type = JOB_NONE;
+		job.buffer = 0;
+	}
+	//! Initializes the bus and, for quad read modes, sets the QE bit.
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int init(void) {
 		spi.master();
 		recoverFromPowerDown();
+		if (USE_CONTINUOUS) {
+			// The flash may still be in continuous read mode after a reset of
+			// the host alone.
+			resetContinuousRead();
+		}
+		if (Addressing::ENTER_4BYTE_MODE) {
+			bus().transfer(CMD_ENTER_4BYTE_ADDRESS_MODE);
+		}
+		return enableQuad(SpiFlashDetail::Bool<USE_QUAD>());
+	}
+	//! Returns the underlying SpiDevice.
+	SpiDevice& device(void) {
+		return spi;
 	}
 	//! Waits for the chip to finish the current operation. Must be called
 	//! after erase/write operations to ensure successive commands are executed.
 	//! \returns SpiFlashErrorSuccess or SpiFlashErrorTimeout otherwise.
 	int wait(void) {
-		recoverFromPowerDown();
-#ifdef ARDUINO
-		const uint32_t TIMEOUT = 800; // 800ms.
-		uint32_t start = millis();
-#else
-		const clock_t TIMEOUT = 0.8 * CLOCKS_PER_SEC; // 800ms.
-		clock_t start = clock();
-#endif
-		while (getStatus() & REG_STATUS_REGISTER_BUSY) {
-#ifdef ARDUINO
-			uint32_t current = millis();
-#else
-			clock_t current = clock();
-#endif
-			if ((current - start) > TIMEOUT) {
-				return SpiFlashErrorTimeout;
-			}
+		return wait(inFlight);
+	}
+	//! Waits for the chip to finish operation, using its typical duration to
+	//! pace the polls and its maximum duration as timeout.
+	//! \param operation Operation in flight, e.g. after a chip erase issued
+	//! through the SpiDevice directly.
+	//! \returns SpiFlashErrorSuccess or SpiFlashErrorTimeout otherwise.
+	int wait(SpiFlashOperation operation) {
+		prepareCommand();
+		// Time already spent since the operation was issued.
+		const uint32_t elapsed =
+			(operation != SpiFlashOperationNone && operation == inFlight) ?
+				(Clock::now() - inFlightStart) : 0;
+		const uint32_t typical = Timing::typical(operation);
+		const uint32_t maximum = Timing::maximum(operation);
+		Busy busy(*this);
+		const uint32_t started = statistics.begin();
+		const uint32_t polls = waiter.getPolls();
+		const int result = waiter.wait(busy,
+			(typical > elapsed) ? (typical - elapsed) : 0,
+			(maximum > elapsed) ? (maximum - elapsed) : 0);
+		statistics.polled(waiter.getPolls() - polls);
+		if (result == SpiFlashErrorTimeout) {
+			statistics.timeout();
 		}
-		return SpiFlashErrorSuccess;
+		statistics.end(SpiFlashStatWait, started, 0, result);
+		inFlight = SpiFlashOperationNone;
+		return result;
+	}
+	//! Returns the wait strategy, e.g. to signal completion or read counters.
+	WaitStrategy& waitStrategy(void) {
+		return waiter;
+	}
+	//! Returns the statistics policy, e.g. to take a snapshot.
+	Stats& stats(void) {
+		return statistics;
 	}
 	//! Returns the contents of SPI Flash status register.
 	//! \returns register contents.
 	uint8_t getStatus(void) {
-		recoverFromPowerDown();
-		return spi.transferRegister(CMD_READ_STATUS_REGISTER, 0);
+		const uint32_t started = statistics.begin();
+		prepareCommand();
+		const uint8_t status =
+			bus().transferRegister(CMD_READ_STATUS_REGISTER, 0);
+		statistics.end(SpiFlashStatGetStatus, started, 1,
+			SpiFlashErrorSuccess);
+		return status;
+	}
+	//! Returns the contents of SPI Flash status register 2 (W25Q only).
+	//! \returns register contents.
+	uint8_t getStatus2(void) {
+		prepareCommand();
+		return bus().transferRegister(CMD_READ_STATUS_REGISTER_2, 0);
 	}
 	//! Sets the SPI Flash status register (non-volatile bits only).
 	//! \param registerValue Status register value.
 	int setStatus(uint8_t registerValue) {
-		recoverFromPowerDown();
+		prepareCommand();
 		//if (checkWriteProtection() != SpiFlashWriteProtectionNone) {
 		//	return SpiFlashErrorAccessDenied;
 		//}
-		writeEnable();
-		spi.transferRegister(CMD_WRITE_STATUS_REGISTER, registerValue);
+		if (job.type != JOB_NONE) {
+			return SpiFlashErrorBusy;
+		}
+		issueSetStatus(registerValue);
 		// Update takes up to 10 ms, so wait for transaction to finish.
 		return wait();
 	}
-	//! Returns the content of SPI Flash memory.
+	//! Returns the content of SPI Flash memory. While an operation started
+	//! with a begin call erases or programs, it is suspended for the read
+	//! unless the read overlaps the range being changed.
 	//! \param data Buffer to write flash contents.
-	//! \param offset
-	//! \param bytes
+	//! \param offset Flash offset to start reading.
+	//! \param bytes Number of bytes to read, may span the whole flash.
 	//! \returns SpiFlashErrorSuccess or non-zero if any error.
-	int read(uint8_t* /*[out]*/ data, uint32_t offset, uint8_t bytes) {
-		if ((offset + bytes) > FLASH_SIZE) {
-			return SpiFlashErrorInputValue;
-		}
-		recoverFromPowerDown();
-		const size_t length = 4 + bytes; // Command + address + bytes.
-		uint8_t* buffer = new uint8_t[length];
-		for (size_t i = 0; i < length; i++) {
-			buffer[i] = 0x00;
-		}
-		buffer[0] = CMD_READ_DATA;
-		buffer[1] = ((offset >> 16) & 0xFF);
-		buffer[2] = ((offset >> 8) & 0xFF);
-		buffer[3] = (offset & 0xFF);
-		spi.transferBulk(buffer, length);
-		memcpy(data, &buffer[4], bytes);
-		delete[] buffer;
-		return SpiFlashErrorSuccess;
+	int read(uint8_t* /*[out]*/ data, uint32_t offset, size_t bytes) {
+		const uint32_t started = statistics.begin();
+		const int result = readData(data, offset, bytes);
+		statistics.end(SpiFlashStatRead, started, bytes, result);
+		return result;
 	}
-	//! Erase SPI flash.
-	//! \param offset Flash offset to start erasing.
-	//! \param bytes Number of bytes to erase.
+	//! Plans the erase of a range with the lowest total typical duration,
+	//! mixing sector (4k), 32k and 64k block erases or a chip erase.
+	//! \param offset Flash offset to start erasing, sector aligned.
+	//! \param bytes Number of bytes to erase, multiple of a sector.
+	//! \param plan Filled with the chosen erase commands.
 	//! \returns SpiFlashErrorSuccess or non-zero if any error.
-	int erase(size_t offset, size_t bytes) {
-		if ((offset + bytes) > FLASH_SIZE) {
+	static int planErase(uint32_t offset, size_t bytes,
+			SpiFlashErasePlan& plan) {
+		plan.sectors = 0;
+		plan.blocks32K = 0;
+		plan.blocks64K = 0;
+		plan.chip = false;
+		plan.typicalMs = 0;
+		plan.skipped = 0;
+		if (isOutOfRange(offset, bytes)) {
 			return SpiFlashErrorInputValue;
 		}
 		// Not aligned to sector(4kb).
 		if (offset % 4096 || bytes % 4096) {
 			return SpiFlashErrorInputValue;
 		}
-		recoverFromPowerDown();
-		// Largest unit is block (32kb).
-		if (offset % (32 * 1024) == 0) {
-			while (bytes != (bytes % (32 * 1024))) {
-				int result = eraseBlock(offset, 32);
-				if (result) {
-					return result;
-				}
-				bytes -= 32 * 1024;
-				offset += 32 * 1024;
+		const bool whole = (offset == 0 && bytes == CAPACITY);
+		uint64_t typical = 0;
+		while (bytes > 0) {
+			const uint8_t unit = eraseUnit(offset, bytes);
+			if (unit == 64) {
+				plan.blocks64K++;
+				typical += ERASE_64K_US;
+			} else if (unit == 32) {
+				plan.blocks32K++;
+				typical += ERASE_32K_US;
+			} else {
+				plan.sectors++;
+				typical += ERASE_4K_US;
 			}
+			bytes -= unit * 1024ul;
+			offset += unit * 1024ul;
 		}
-		// Largest unit is sector(4kb).
-		while (bytes != (bytes % (4 * 1024))) {
-			int result = eraseBlock(offset, 4);
-			if (result) {
-				result;
-			}
-			bytes -= 4 * 1024;
-			offset += 4 * 1024;
+		const uint64_t chip = Timing::typical(SpiFlashOperationChipErase);
+		if (whole && chip < typical) {
+			plan.sectors = 0;
+			plan.blocks32K = 0;
+			plan.blocks64K = 0;
+			plan.chip = true;
+			typical = chip;
 		}
+		plan.typicalMs = typical / 1000;
 		return SpiFlashErrorSuccess;
 	}
+	//! Erase SPI flash with the plan of planErase().
+	//! \param offset Flash offset to start erasing.
+	//! \param bytes Number of bytes to erase.
+	//! \param plan Optionally filled with the erase commands used.
+	//! \param mode SpiFlashEraseBlankCheck reads each sector first and only
+	//! erases those not blank, plan then reports the erases issued and the
+	//! sectors skipped.
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int erase(uint32_t offset, size_t bytes, SpiFlashErasePlan* plan = 0,
+			SpiFlashEraseMode mode = SpiFlashEraseAll) {
+		const uint32_t started = statistics.begin();
+		const int result = eraseRange(offset, bytes, plan, mode);
+		statistics.end(SpiFlashStatErase, started, bytes, result);
+		return result;
+	}
 	//! Write to SPI Flash. Assumes already erased.
 	//! \param data Data to write to Flash.
 	//! \param offset Flash offset to write.
+	//! \param bytes Number of bytes to write, programmed page by page.
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int write(const uint8_t* /*[in]*/ data, uint32_t offset, size_t bytes) {
+		return write(data, offset, bytes, 0);
+	}
+	//! Write to SPI Flash like write(), optionally verifying each page
+	//! right after it is programmed.
+	//! \param mode SpiFlashWriteVerify to read back and check each page.
+	//! \param failed Receives the offset of the page that failed to verify.
+	//! \returns SpiFlashErrorSuccess, SpiFlashErrorVerify if a page did not
+	//! verify after a retry or non-zero if any other error.
+	int write(const uint8_t* /*[in]*/ data, uint32_t offset, size_t bytes,
+			SpiFlashWriteMode mode, uint32_t* /*[out]*/ failed = 0) {
+		return write(data, offset, bytes, 0, 0, mode, failed);
+	}
+	//! Write to SPI Flash like write(), transforming each page payload on
+	//! its way. The transform runs while the previous page programs, so it
+	//! adds no time unless it is slower than a page program. A verification
+	//! checks the transformed payload.
+	//! \param transform Called on each payload, or 0.
+	//! \param context Passed to transform.
+	//! \param mode SpiFlashWriteVerify to read back and check each page.
+	//! \param failed Receives the offset of the page that failed to verify.
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int write(const uint8_t* /*[in]*/ data, uint32_t offset, size_t bytes,
+			SpiFlashPageTransform transform, void* context = 0,
+			SpiFlashWriteMode mode = SpiFlashWriteProgram,
+			uint32_t* /*[out]*/ failed = 0) {
+		const uint32_t started = statistics.begin();
+		const int result = writeData(data, offset, bytes, transform, context,
+			mode, failed);
+		statistics.end(SpiFlashStatWrite, started, bytes, result);
+		return result;
+	}
+	//! Writes data whatever the flash holds, using NOR semantics to avoid
+	//! erases: pages that already match are skipped, pages where data only
+	//! clears bits are programmed in place. Only sectors where a bit must be
+	//! set are read, erased and programmed again, which needs a 4k buffer
+	//! (SCRATCH_SIZE of at least UPDATE_SCRATCH_SIZE).
+	//! \param data Data to write to Flash.
+	//! \param offset Flash offset to write.
 	//! \param bytes Number of bytes to write.
 	//! \returns SpiFlashErrorSuccess or non-zero if any error.
-	int write(const uint8_t* const /*[in]*/ data, uint32_t offset,
-			uint8_t bytes) {
-		if (!data || ((offset + bytes) > FLASH_SIZE)) {
+	int update(const uint8_t* /*[in]*/ data, uint32_t offset, size_t bytes) {
+		static_assert(SCRATCH_SIZE == 0 || SCRATCH_SIZE >= UPDATE_SCRATCH_SIZE,
+			"update() needs SCRATCH_SIZE of at least UPDATE_SCRATCH_SIZE");
+		const uint32_t started = statistics.begin();
+		const int result = updateData(data, offset, bytes);
+		statistics.end(SpiFlashStatWrite, started, bytes, result);
+		return result;
+	}
+	//! Starts erasing like erase() and returns at once, poll() issues the
+	//! erase commands as the flash becomes idle.
+	//! \param handle Optionally receives the handle of the operation.
+	//! \returns SpiFlashErrorSuccess if started, SpiFlashErrorBusy while
+	//! another operation runs or non-zero if any other error.
+	int beginErase(uint32_t offset, size_t bytes,
+			SpiFlashHandle* handle = 0) {
+		SpiFlashErasePlan plan;
+		int result = planErase(offset, bytes, plan);
+		if (result) {
+			return result;
+		}
+		if (job.type != JOB_NONE) {
+			return SpiFlashErrorBusy;
+		}
+		startJob(JOB_ERASE, offset, bytes, handle);
+		job.chip = plan.chip;
+		return poll() == SpiFlashErrorBusy ? SpiFlashErrorSuccess : lastResult;
+	}
+	//! Starts writing like write() and returns at once, poll() issues the
+	//! page programs as the flash becomes idle. data must stay valid until
+	//! the operation completed.
+	//! \param handle Optionally receives the handle of the operation.
+	//! \returns SpiFlashErrorSuccess if started, SpiFlashErrorBusy while
+	//! another operation runs or non-zero if any other error.
+	int beginWrite(const uint8_t* /*[in]*/ data, uint32_t offset, size_t bytes,
+			SpiFlashHandle* handle = 0) {
+		if (!data || isOutOfRange(offset, bytes)) {
 			return SpiFlashErrorInputValue;
 		}
-		recoverFromPowerDown();
-		uint16_t writeSize;
-		while (bytes > 0) {
-			// Write length can not go beyond the end of the flash page.
-			writeSize = 256 - (offset & 0xFF);
-			writeSize = (bytes <= writeSize) ? bytes : writeSize;
-			// Wait for previous operation to complete.
-			int result = wait();
-			if (result) {
-				return result;
-			}
-			// Enable writing to SPI flash.
-			writeEnable();
-			const size_t length = 4 + writeSize; // Command + address + bytes.
-			uint8_t* buffer = new uint8_t[length];
-			for (size_t i = 0; i < length; i++) {
-				buffer[i] = 0x00;
+		if (job.type != JOB_NONE) {
+			return SpiFlashErrorBusy;
+		}
+		startJob(JOB_WRITE, offset, bytes, handle);
+		job.data = data;
+		job.buffer = acquire(PAGE_BUFFER, PAGE_BUFFER_SIZE);
+		return poll() == SpiFlashErrorBusy ? SpiFlashErrorSuccess : lastResult;
+	}
+	//! Starts writing the status register like setStatus() and returns at once.
+	//! \param handle Optionally receives the handle of the operation.
+	//! \returns SpiFlashErrorSuccess if started or SpiFlashErrorBusy while
+	//! another operation runs.
+	int beginSetStatus(uint8_t registerValue, SpiFlashHandle* handle = 0) {
+		if (job.type != JOB_NONE) {
+			return SpiFlashErrorBusy;
+		}
+		startJob(JOB_SET_STATUS, 0, 1, handle);
+		job.value = registerValue;
+		return poll() == SpiFlashErrorBusy ? SpiFlashErrorSuccess : lastResult;
+	}
+	//! Advances the started operation: checks the busy flag once and issues
+	//! the next command when the flash is idle. Call it regularly from the
+	//! main loop.
+	//! \returns SpiFlashErrorBusy while the operation runs, otherwise its
+	//! result (SpiFlashErrorSuccess if none was started).
+	int poll(void) {
+		if (job.type == JOB_NONE) {
+			return SpiFlashErrorSuccess;
+		}
+		prepareCommand();
+		if (inFlight != SpiFlashOperationNone) {
+			if (getStatus() & REG_STATUS_REGISTER_BUSY) {
+				if ((Clock::now() - inFlightStart) >
+						Timing::maximum(inFlight)) {
+					statistics.timeout();
+					inFlight = SpiFlashOperationNone;
+					return finishJob(SpiFlashErrorTimeout);
+				}
+				return SpiFlashErrorBusy;
 			}
-			buffer[0] = CMD_PAGE_PROGRAM;
-			buffer[1] = ((offset >> 16) & 0xFF);
-			buffer[2] = ((offset >> 8) & 0xFF);
-			buffer[3] = (offset & 0xFF);
-			memcpy(&buffer[4], data, writeSize);
-			spi.transferBulk(buffer, length);
-			delete[] buffer;
-			data += writeSize;
-			offset += writeSize;
-			bytes -= writeSize;
+			inFlight = SpiFlashOperationNone;
 		}
-		// Wait for previous operation to complete.
-		return wait();
+		if (!issueJob()) {
+			return finishJob(SpiFlashErrorSuccess);
+		}
+		return SpiFlashErrorBusy;
+	}
+	//! Returns the state of a started operation.
+	//! \returns SpiFlashErrorBusy while it runs, its result if it was the last
+	//! one to complete or SpiFlashErrorInputValue for an unknown handle.
+	int getResult(SpiFlashHandle handle) const {
+		if (job.type != JOB_NONE && handle == job.handle) {
+			return SpiFlashErrorBusy;
+		}
+		if (handle != 0 && handle == lastHandle) {
+			return lastResult;
+		}
+		return SpiFlashErrorInputValue;
+	}
+	//! Whether an operation started with a begin call is still running.
+	bool isBusy(void) const {
+		return job.type != JOB_NONE;
+	}
+	//! Sets the function poll() calls when an operation completed.
+	void onComplete(SpiFlashCallback function, void* context = 0) {
+		callback = function;
+		callbackContext = context;
 	}
 	//! Returns the SPI flash JEDEC ID (manufacturer ID, memory type, and
 	//! capacity).
 	//! \returns Flash JEDEC ID or 0 on error.
 	uint32_t getJedecId(void) {
-		recoverFromPowerDown();
+		prepareCommand();
 		uint32_t jedecId = 0;
 		const size_t length = 4; // Command + manufacturer + type + capacity.
 		uint8_t buffer[length] = { 0 };
 		buffer[0] = CMD_JEDEC_ID;
-		spi.transferBulk(buffer, length);
+		bus().transferBulk(buffer, length);
 		jedecId =
 			((uint32_t)buffer[1] << 16) |
 			((uint32_t)buffer[2] <<  8) |
@@ -266,27 +1899,24 @@ public:
 	//! Returns the SPI flash unique ID (serial).
 	//! \returns Flash unique ID or 0 on error.
 	uint64_t getUniqueId(void) {
-		recoverFromPowerDown();
+		prepareCommand();
 		uint64_t uniqueId = 0;
-		const size_t length = 5 + 8; // Command + dummy bytes + unique id.
-		uint8_t buffer[length] = { 0 };
+		// One more dummy byte in 4-byte address mode.
+		const size_t dummy = Addressing::ENTER_4BYTE_MODE ? 5 : 4;
+		const size_t length = 1 + dummy + 8; // Command + dummy + unique id.
+		uint8_t buffer[1 + 5 + 8] = { 0 };
 		buffer[0] = CMD_READ_UNIQUE_ID;
-		spi.transferBulk(buffer, length);
-		uniqueId =
-			((uint64_t)buffer[5]  << 56) |
-			((uint64_t)buffer[6]  << 48) |
-			((uint64_t)buffer[7]  << 40) |
-			((uint64_t)buffer[8]  << 32) |
-			((uint64_t)buffer[9]  << 24) |
-			((uint64_t)buffer[10] << 16) |
-			((uint64_t)buffer[11] <<  8) |
-			((uint64_t)buffer[12] <<  0);
+		bus().transferBulk(buffer, length);
+		for (size_t i = 1 + dummy; i < length; i++) {
+			uniqueId = (uniqueId << 8) | buffer[i];
+		}
 		return uniqueId;
 	}
 	//! Set Flash memory in power down mode.
 	void sleep(void) {
-		if (!isPoweredDown) {
-			spi.transfer(CMD_POWER_DOWN);
+		if (!isPoweredDown && job.type == JOB_NONE) {
+			prepareCommand();
+			bus().transfer(CMD_POWER_DOWN);
 			isPoweredDown = true;
 		}
 	}
@@ -0,0 +1,238 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef SPI_FLASH_CACHE_H
+#define SPI_FLASH_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+
+//! Read cache in front of a SpiFlash. Keeps CACHE_SIZE bytes of flash in
+//! lines of LINE_SIZE (256 byte pages or 4k sectors), replaced least recently
+//! used. Reads continuing where the previous one ended are treated as a
+//! sequential stream and the lines following the read are prefetched. Writes
+//! and erases must go through the cache so overlapping lines are invalidated;
+//! after modifying the flash directly call invalidate().
+//!
+//! SpiFlash<SpiDevice<8> > flash;
+//! SpiFlashCache<SpiFlash<SpiDevice<8> >, 1024> cache(flash);
+template<typename Flash, size_t CACHE_SIZE = 1024, size_t LINE_SIZE = 256>
+class SpiFlashCache {
+
+	static_assert(LINE_SIZE == 256 || LINE_SIZE == 4096,
+		"LINE_SIZE must be a page (256) or a sector (4096)");
+	static_assert(CACHE_SIZE >= LINE_SIZE,
+		"CACHE_SIZE must hold at least one line");
+
+	enum {
+		LINES = CACHE_SIZE / LINE_SIZE,
+		//! Lines fetched ahead of a sequential stream, at most half the cache.
+		PREFETCH_LINES = (LINES > 1) ? (LINES / 2) : 0,
+	};
+
+	static const uint32_t INVALID = 0xFFFFFFFFul;
+
+	Flash& flash;
+	uint8_t lines[LINES][LINE_SIZE];
+	//! Flash offset of each line, INVALID if empty.
+	uint32_t tags[LINES];
+	//! Access stamp of each line for LRU replacement.
+	uint32_t stamps[LINES];
+	uint32_t stamp;
+	//! End of the previous read, for sequential stream detection.
+	uint32_t lastEnd;
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t prefetches;
+
+	int find(uint32_t base) const {
+		for (int i = 0; i < LINES; i++) {
+			if (tags[i] == base) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	//! Returns an empty or the least recently used line.
+	int victim(void) const {
+		int line = 0;
+		for (int i = 0; i < LINES; i++) {
+			if (tags[i] == INVALID) {
+				return i;
+			}
+			if (stamps[i] < stamps[line]) {
+				line = i;
+			}
+		}
+		return line;
+	}
+
+	void touch(int line) {
+		stamps[line] = ++stamp;
+	}
+
+	//! Loads the line at base from flash.
+	//! \returns Line index or negative error code.
+	int fill(uint32_t base) {
+		const int line = victim();
+		tags[line] = INVALID;
+		int result = flash.read(lines[line], base, LINE_SIZE);
+		if (result) {
+			return -result;
+		}
+		tags[line] = base;
+		touch(line);
+		return line;
+	}
+
+	//! Fetches the lines following end that are not cached yet. Prefetched
+	//! lines get newer stamps than the lines used before, the caller stamps
+	//! the line in use again afterwards so they are older than that one.
+	void prefetch(uint32_t end) {
+		uint32_t base = end - (end % LINE_SIZE);
+		if (base != end) {
+			base += LINE_SIZE;
+		}
+		for (int i = 0; i < PREFETCH_LINES; i++, base += LINE_SIZE) {
+			if (find(base) >= 0) {
+				continue;
+			}
+			// Stops at the end of the flash.
+			if (fill(base) < 0) {
+				break;
+			}
+			prefetches++;
+		}
+	}
+
+	//! Drops all lines overlapping [offset, offset + bytes).
+	void invalidate(uint32_t offset, size_t bytes) {
+		for (int i = 0; i < LINES; i++) {
+			if (tags[i] != INVALID && tags[i] < offset + bytes &&
+					offset < tags[i] + LINE_SIZE) {
+				tags[i] = INVALID;
+			}
+		}
+	}
+
+public:
+	explicit SpiFlashCache(Flash& flash) : flash(flash), stamp(0),
+			lastEnd(INVALID), hits(0), misses(0), prefetches(0) {
+		invalidate();
+	}
+	//! Reads through the cache, see SpiFlash::read().
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int read(uint8_t* /*[out]*/ data, uint32_t offset, size_t bytes) {
+		const bool sequential = (offset == lastEnd);
+		lastEnd = offset + bytes;
+		// Reads larger than the cache would only evict it.
+		if (bytes >= CACHE_SIZE) {
+			return flash.read(data, offset, bytes);
+		}
+		if (!data) {
+			return SpiFlashErrorInputValue;
+		}
+		// Line holding the end of the read, -1 if read uncached.
+		int line = -1;
+		while (bytes > 0) {
+			const uint32_t base = offset - (offset % LINE_SIZE);
+			const size_t skip = offset - base;
+			const size_t length =
+				(bytes < LINE_SIZE - skip) ? bytes : (LINE_SIZE - skip);
+			line = find(base);
+			if (line >= 0) {
+				hits++;
+				touch(line);
+			} else {
+				misses++;
+				line = fill(base);
+				if (line < 0) {
+					// Line crosses the end of the flash, read uncached.
+					int result = flash.read(data, offset, length);
+					if (result) {
+						return result;
+					}
+					data += length;
+					offset += length;
+					bytes -= length;
+					continue;
+				}
+			}
+			memcpy(data, &lines[line][skip], length);
+			data += length;
+			offset += length;
+			bytes -= length;
+		}
+		if (sequential) {
+			prefetch(offset);
+			if (line >= 0) {
+				// The line in use stays the most recently used one.
+				touch(line);
+			}
+		}
+		return SpiFlashErrorSuccess;
+	}
+	//! Writes and invalidates the cached lines, see SpiFlash::write().
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int write(const uint8_t* /*[in]*/ data, uint32_t offset, size_t bytes) {
+		invalidate(offset, bytes);
+		return flash.write(data, offset, bytes);
+	}
+	//! Erases and invalidates the cached lines, see SpiFlash::erase().
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int erase(uint32_t offset, size_t bytes) {
+		invalidate(offset, bytes);
+		return flash.erase(offset, bytes);
+	}
+	//! Drops all cached lines.
+	void invalidate(void) {
+		for (int i = 0; i < LINES; i++) {
+			tags[i] = INVALID;
+			stamps[i] = 0;
+		}
+	}
+	//! Reads served from the cache, counted per line touched.
+	uint32_t getHits(void) const {
+		return hits;
+	}
+	//! Lines loaded on demand.
+	uint32_t getMisses(void) const {
+		return misses;
+	}
+	//! Lines loaded ahead of a sequential stream.
+	uint32_t getPrefetches(void) const {
+		return prefetches;
+	}
+	void resetCounters(void) {
+		hits = 0;
+		misses = 0;
+		prefetches = 0;
+	}
+};
+
+#endif // SPI_FLASH_CACHE_H
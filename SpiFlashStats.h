@@ -0,0 +1,184 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+#ifndef SPI_FLASH_STATS_H
+#define SPI_FLASH_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+
+//! Latency histogram in microseconds with HDR-style buckets: each power of two
+//! is split into SUB_BUCKETS linear buckets, so every bucket is within 25% of
+//! the values it holds while covering the whole 32 bit range.
+struct SpiFlashHistogram {
+	enum {
+		SUB_BUCKETS = 4,
+		SUB_BUCKET_BITS = 2,
+		BUCKETS = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+	};
+
+	uint32_t counts[BUCKETS];
+
+	//! Bucket of value.
+	static uint8_t bucket(uint32_t value) {
+		if (value < SUB_BUCKETS) {
+			return static_cast<uint8_t>(value);
+		}
+		// Shift value into [SUB_BUCKETS, 2 * SUB_BUCKETS).
+		uint8_t shift = 0;
+		while ((value >> shift) >= (2 * SUB_BUCKETS)) {
+			shift++;
+		}
+		return static_cast<uint8_t>((shift + 1) * SUB_BUCKETS +
+			((value >> shift) & (SUB_BUCKETS - 1)));
+	}
+
+	//! Lowest value of a bucket.
+	static uint32_t lowest(uint8_t index) {
+		if (index < SUB_BUCKETS) {
+			return index;
+		}
+		const uint8_t shift = index / SUB_BUCKETS - 1;
+		return static_cast<uint32_t>(SUB_BUCKETS + index % SUB_BUCKETS)
+			<< shift;
+	}
+
+	//! Highest value of a bucket.
+	static uint32_t highest(uint8_t index) {
+		return (index + 1 < BUCKETS) ? (lowest(index + 1) - 1) : 0xFFFFFFFFul;
+	}
+
+	void add(uint32_t value) {
+		counts[bucket(value)]++;
+	}
+
+	//! Returns the value percent of the samples are at or below, as the
+	//! highest value of its bucket, 0 without samples.
+	uint32_t getPercentile(uint8_t percent) const {
+		uint64_t total = 0;
+		for (int i = 0; i < BUCKETS; i++) {
+			total += counts[i];
+		}
+		const uint64_t rank = (total * percent + 99) / 100;
+		uint64_t seen = 0;
+		for (int i = 0; i < BUCKETS; i++) {
+			seen += counts[i];
+			if (counts[i] && seen >= rank) {
+				return highest(i);
+			}
+		}
+		return 0;
+	}
+};
+
+//! Counters of one public SpiFlash operation.
+struct SpiFlashCallStats {
+	uint32_t calls;
+	//! Calls returning an error.
+	uint32_t errors;
+	uint64_t bytes;
+	uint32_t maximumUs;
+	SpiFlashHistogram latencyUs;
+};
+
+//! Everything SpiFlashStats collects, indexed by SpiFlashStat.
+struct SpiFlashStatsSnapshot {
+	SpiFlashCallStats operations[SpiFlashStatCount];
+	//! SPI transactions issued.
+	uint32_t commands;
+	//! Status polls of all waits, per wait with operations[SpiFlashStatWait].
+	uint32_t polls;
+	uint32_t timeouts;
+	//! Releases from power-down.
+	uint32_t wakeups;
+};
+
+//! Statistics policy keeping latency histograms and counters of read(),
+//! write(), erase(), wait() and getStatus(), measured on Clock. Takes about
+//! 2.5k of RAM, meant for hosts and larger MCUs.
+//!
+//! SpiFlash<SpiDevice<8>, 0x7FFFF, SpiFlashReadNormal,
+//!     SpiFlashAddress3Byte, SpiFlashWaitSpin<>, SpiFlashTimingW25Q,
+//!     SpiFlashStats<> > flash;
+//! SpiFlashStatsSnapshot snapshot = flash.stats().snapshot();
+template<typename Clock = SpiFlashClock>
+class SpiFlashStats {
+
+	SpiFlashStatsSnapshot data;
+
+public:
+	SpiFlashStats() {
+		reset();
+	}
+
+	uint32_t begin(void) {
+		return Clock::now();
+	}
+
+	void end(SpiFlashStat stat, uint32_t started, size_t bytes, int result) {
+		const uint32_t latency = Clock::now() - started;
+		SpiFlashCallStats& operation = data.operations[stat];
+		operation.calls++;
+		if (result) {
+			operation.errors++;
+		} else {
+			operation.bytes += bytes;
+		}
+		if (latency > operation.maximumUs) {
+			operation.maximumUs = latency;
+		}
+		operation.latencyUs.add(latency);
+	}
+
+	void command(void) {
+		data.commands++;
+	}
+
+	void polled(uint32_t polls) {
+		data.polls += polls;
+	}
+
+	void timeout(void) {
+		data.timeouts++;
+	}
+
+	void wakeup(void) {
+		data.wakeups++;
+	}
+
+	//! Returns a copy of the statistics collected since the last reset().
+	SpiFlashStatsSnapshot snapshot(void) const {
+		return data;
+	}
+
+	void reset(void) {
+		memset(&data, 0, sizeof(data));
+	}
+};
+
+#endif // SPI_FLASH_STATS_H
@@ -0,0 +1,293 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+#ifndef SPI_FLASH_TRACE_H
+#define SPI_FLASH_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef ARDUINO
+#include <stdio.h>
+#endif
+
+#include "SpiFlash.h"
+
+//! One SPI transaction recorded by SpiFlashTrace. Back to back status
+//! register 1 reads are merged into a single event spanning the busy wait,
+//! polls counts them.
+struct SpiFlashTraceEvent {
+	//! Start and duration in microseconds of the trace clock.
+	uint32_t start;
+	uint32_t duration;
+	//! Flash address, 0 for commands without one.
+	uint32_t address;
+	//! Bytes clocked, including command, address and dummy bytes.
+	uint32_t length;
+	uint16_t polls;
+	uint8_t opcode;
+};
+
+//! SpiDevice wrapper recording every transaction between SpiFlash and the
+//! device in a ring buffer of EVENTS entries; the oldest are overwritten.
+//! Provides transferIn() and transferLanes() if the wrapped device does. The
+//! timestamps are taken on Clock, use the clock of the wait strategy.
+//!
+//! SpiFlash<SpiFlashTrace<SpiDevice<8> > > flash;
+//! flash.device().writeChromeTrace(file);
+template<typename SpiDevice, typename Clock = SpiFlashClock,
+	size_t EVENTS = 256>
+class SpiFlashTrace {
+
+	static_assert(EVENTS > 0, "EVENTS must hold at least one event");
+
+	enum {
+		CMD_PAGE_PROGRAM = 0x02,
+		CMD_READ_DATA = 0x03,
+		CMD_READ_STATUS_REGISTER = 0x05,
+		CMD_FAST_READ = 0x0B,
+		CMD_FAST_READ_4BYTE = 0x0C,
+		CMD_PAGE_PROGRAM_4BYTE = 0x12,
+		CMD_READ_DATA_4BYTE = 0x13,
+		CMD_SECTOR_ERASE_4K = 0x20,
+		CMD_SECTOR_ERASE_4K_4BYTE = 0x21,
+		CMD_FAST_READ_DUAL_OUTPUT = 0x3B,
+		CMD_FAST_READ_DUAL_OUTPUT_4BYTE = 0x3C,
+		CMD_BLOCK_ERASE_32K = 0x52,
+		CMD_FAST_READ_QUAD_OUTPUT = 0x6B,
+		CMD_FAST_READ_QUAD_OUTPUT_4BYTE = 0x6C,
+		CMD_ENTER_4BYTE_ADDRESS_MODE = 0xB7,
+		CMD_FAST_READ_DUAL_IO = 0xBB,
+		CMD_FAST_READ_DUAL_IO_4BYTE = 0xBC,
+		CMD_BLOCK_ERASE_64K = 0xD8,
+		CMD_BLOCK_ERASE_64K_4BYTE = 0xDC,
+		CMD_EXIT_4BYTE_ADDRESS_MODE = 0xE9,
+		CMD_FAST_READ_QUAD_IO = 0xEB,
+		CMD_FAST_READ_QUAD_IO_4BYTE = 0xEC,
+	};
+
+	SpiDevice spi;
+	SpiFlashTraceEvent events[EVENTS];
+	//! Next entry to write and number of valid entries.
+	size_t head;
+	size_t count;
+	uint32_t dropped;
+	bool isAddressMode4Byte;
+
+	//! Address bytes following opcode, 0 if it has none.
+	size_t addressBytes(uint8_t opcode) const {
+		switch (opcode) {
+		case CMD_PAGE_PROGRAM_4BYTE:
+		case CMD_READ_DATA_4BYTE:
+		case CMD_FAST_READ_4BYTE:
+		case CMD_SECTOR_ERASE_4K_4BYTE:
+		case CMD_FAST_READ_DUAL_OUTPUT_4BYTE:
+		case CMD_FAST_READ_QUAD_OUTPUT_4BYTE:
+		case CMD_FAST_READ_DUAL_IO_4BYTE:
+		case CMD_BLOCK_ERASE_64K_4BYTE:
+		case CMD_FAST_READ_QUAD_IO_4BYTE:
+			return 4;
+		case CMD_PAGE_PROGRAM:
+		case CMD_READ_DATA:
+		case CMD_FAST_READ:
+		case CMD_SECTOR_ERASE_4K:
+		case CMD_FAST_READ_DUAL_OUTPUT:
+		case CMD_BLOCK_ERASE_32K:
+		case CMD_FAST_READ_QUAD_OUTPUT:
+		case CMD_FAST_READ_DUAL_IO:
+		case CMD_BLOCK_ERASE_64K:
+		case CMD_FAST_READ_QUAD_IO:
+			return isAddressMode4Byte ? 4 : 3;
+		default:
+			return 0;
+		}
+	}
+
+	uint32_t decodeAddress(uint8_t opcode, const uint8_t* address,
+			size_t length) const {
+		const size_t bytes = addressBytes(opcode);
+		uint32_t offset = 0;
+		for (size_t i = 0; i < bytes && i < length; i++) {
+			offset = (offset << 8) | address[i];
+		}
+		return offset;
+	}
+
+	void record(uint8_t opcode, uint32_t address, size_t length,
+			uint32_t start) {
+		const uint32_t end = Clock::now();
+		if (opcode == CMD_READ_STATUS_REGISTER && count > 0) {
+			SpiFlashTraceEvent& last = events[(head + EVENTS - 1) % EVENTS];
+			// Only polls back to back, a poll after an idle gap starts a new
+			// event.
+			if (last.opcode == CMD_READ_STATUS_REGISTER &&
+					last.start + last.duration == start &&
+					last.polls < 0xFFFF) {
+				last.duration = end - last.start;
+				last.polls++;
+				return;
+			}
+		}
+		SpiFlashTraceEvent& event = events[head];
+		event.start = start;
+		event.duration = end - start;
+		event.address = address;
+		event.length = static_cast<uint32_t>(length);
+		event.polls = (opcode == CMD_READ_STATUS_REGISTER) ? 1 : 0;
+		event.opcode = opcode;
+		head = (head + 1) % EVENTS;
+		if (count < EVENTS) {
+			count++;
+		} else {
+			dropped++;
+		}
+	}
+
+	void track(uint8_t opcode) {
+		if (opcode == CMD_ENTER_4BYTE_ADDRESS_MODE) {
+			isAddressMode4Byte = true;
+		} else if (opcode == CMD_EXIT_4BYTE_ADDRESS_MODE) {
+			isAddressMode4Byte = false;
+		}
+	}
+
+public:
+	SpiFlashTrace() : head(0), count(0), dropped(0),
+			isAddressMode4Byte(false) {
+	}
+
+	void master(void) {
+		spi.master();
+	}
+
+	uint8_t transfer(uint8_t data) {
+		const uint32_t start = Clock::now();
+		const uint8_t result = spi.transfer(data);
+		track(data);
+		record(data, 0, 1, start);
+		return result;
+	}
+
+	void transferBulk(uint8_t* buffer, size_t length) {
+		// The buffer is overwritten with received data, decode first.
+		const uint8_t opcode = (length > 0) ? buffer[0] : 0;
+		const uint32_t address = (length > 0) ?
+			decodeAddress(opcode, &buffer[1], length - 1) : 0;
+		const uint32_t start = Clock::now();
+		spi.transferBulk(buffer, length);
+		record(opcode, address, length, start);
+	}
+
+	uint8_t transferRegister(uint8_t command, uint8_t value) {
+		const uint32_t start = Clock::now();
+		const uint8_t result = spi.transferRegister(command, value);
+		record(command, 0, 2, start);
+		return result;
+	}
+
+	template<typename Device = SpiDevice>
+	auto transferIn(const uint8_t* header, size_t headerLength, uint8_t* data,
+			size_t length) -> decltype(static_cast<Device*>(0)->transferIn(
+				header, headerLength, data, length)) {
+		const uint8_t opcode = (headerLength > 0) ? header[0] : 0;
+		const uint32_t start = Clock::now();
+		spi.transferIn(header, headerLength, data, length);
+		record(opcode, (headerLength > 0) ?
+			decodeAddress(opcode, &header[1], headerLength - 1) : 0,
+			headerLength + length, start);
+	}
+
+	template<typename Device = SpiDevice>
+	auto transferLanes(const SpiFlashLaneTransfer& transfer) -> decltype(
+			static_cast<Device*>(0)->transferLanes(transfer)) {
+		const uint32_t start = Clock::now();
+		spi.transferLanes(transfer);
+		record(transfer.command, decodeAddress(transfer.command,
+			transfer.address, transfer.addressLength),
+			(transfer.skipCommand ? 0 : 1) + transfer.addressLength +
+			transfer.dummyClocks / 8 + transfer.length, start);
+	}
+
+	//! Returns the wrapped SpiDevice.
+	SpiDevice& device(void) {
+		return spi;
+	}
+
+	//! Number of recorded events, at most EVENTS.
+	size_t getEvents(void) const {
+		return count;
+	}
+
+	//! Returns a recorded event, 0 is the oldest.
+	const SpiFlashTraceEvent& getEvent(size_t index) const {
+		return events[(head + EVENTS - count + index) % EVENTS];
+	}
+
+	//! Events overwritten since the last clear().
+	uint32_t getDropped(void) const {
+		return dropped;
+	}
+
+	void clear(void) {
+		head = 0;
+		count = 0;
+		dropped = 0;
+	}
+
+#ifndef ARDUINO
+	//! Writes the recorded events as Chrome trace-event JSON, to be opened
+	//! in chrome://tracing or Perfetto. Transactions appear on the "bus"
+	//! track, merged status polls on the "busy wait" track.
+	//! \returns SpiFlashErrorSuccess, SpiFlashErrorInputValue without a file
+	//! or SpiFlashErrorAccessDenied if it could not be written.
+	int writeChromeTrace(FILE* file) const {
+		if (!file) {
+			return SpiFlashErrorInputValue;
+		}
+		fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+		fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":1,\"args\":{\"name\":\"bus\"}},\n");
+		fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":2,\"args\":{\"name\":\"busy wait\"}}");
+		for (size_t i = 0; i < count; i++) {
+			const SpiFlashTraceEvent& event = getEvent(i);
+			const bool poll = event.opcode == CMD_READ_STATUS_REGISTER;
+			fprintf(file, ",\n{\"name\":\"0x%02X\",\"cat\":\"spi\","
+				"\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":1,\"tid\":%d,"
+				"\"args\":{\"address\":\"0x%06lX\",\"length\":%lu,"
+				"\"polls\":%u}}", event.opcode,
+				static_cast<unsigned long>(event.start),
+				static_cast<unsigned long>(event.duration), poll ? 2 : 1,
+				static_cast<unsigned long>(event.address),
+				static_cast<unsigned long>(event.length), event.polls);
+		}
+		fprintf(file, "\n]}\n");
+		return ferror(file) ? SpiFlashErrorAccessDenied : SpiFlashErrorSuccess;
+	}
+#endif
+};
+
+#endif // SPI_FLASH_TRACE_H
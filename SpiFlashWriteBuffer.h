@@ -0,0 +1,194 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef SPI_FLASH_WRITE_BUFFER_H
+#define SPI_FLASH_WRITE_BUFFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+
+//! Write-back buffer in front of a SpiFlash. Writes are collected in a RAM
+//! image of one 256 byte page and the page is programmed once: when it is
+//! completely written, when a write to another page or an overlapping read
+//! arrives, or on flush(). Since programming 0xFF leaves NOR flash
+//! unchanged, untouched bytes stay 0xFF in the image and repeated writes to the
+//! same byte are ANDed, exactly like successive page programs would do.
+//! Call flush() before power loss or before accessing the flash directly.
+//!
+//! SpiFlash<SpiDevice<8> > flash;
+//! SpiFlashWriteBuffer<SpiFlash<SpiDevice<8> > > buffer(flash);
+template<typename Flash>
+class SpiFlashWriteBuffer {
+
+	enum { PAGE_SIZE = 256 };
+
+	static const uint32_t INVALID = 0xFFFFFFFFul;
+
+	Flash& flash;
+	uint8_t page[PAGE_SIZE];
+	//! Bit per byte of the page that has been written.
+	uint8_t written[PAGE_SIZE / 8];
+	//! Flash offset of the buffered page, INVALID if empty.
+	uint32_t base;
+	//! Pending range within the page.
+	uint16_t first;
+	uint16_t last;
+	uint16_t count;
+	uint32_t writes;
+	uint32_t programs;
+
+	void clear(void) {
+		memset(page, 0xFF, sizeof(page));
+		memset(written, 0, sizeof(written));
+		base = INVALID;
+		first = PAGE_SIZE;
+		last = 0;
+		count = 0;
+	}
+
+	bool overlaps(uint32_t offset, size_t bytes) const {
+		return base != INVALID && (base + first) < (offset + bytes) &&
+			offset <= (base + last);
+	}
+
+	//! Merges a fragment lying within one page into the image.
+	void merge(const uint8_t* data, uint32_t offset, size_t bytes) {
+		base = offset - (offset % PAGE_SIZE);
+		const uint16_t start = offset - base;
+		for (uint16_t i = start; i < start + bytes; i++) {
+			page[i] &= *data++;
+			if (!(written[i / 8] & (1 << (i % 8)))) {
+				written[i / 8] |= (1 << (i % 8));
+				count++;
+			}
+		}
+		first = (start < first) ? start : first;
+		last = (start + bytes - 1 > last) ? (start + bytes - 1) : last;
+	}
+
+public:
+	explicit SpiFlashWriteBuffer(Flash& flash) : flash(flash), writes(0),
+			programs(0) {
+		clear();
+	}
+	//! Programs the pending bytes of the buffered page, if any. If that
+	//! fails the page stays buffered.
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int flush(void) {
+		if (base == INVALID) {
+			return SpiFlashErrorSuccess;
+		}
+		int result = flash.write(&page[first], base + first, last - first + 1);
+		if (result) {
+			return result;
+		}
+		programs++;
+		clear();
+		return SpiFlashErrorSuccess;
+	}
+	//! Buffers data for programming, see SpiFlash::write(). Full pages that are
+	//! not buffered are programmed right away.
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int write(const uint8_t* /*[in]*/ data, uint32_t offset, size_t bytes) {
+		if (!data || bytes > Flash::CAPACITY ||
+				offset > Flash::CAPACITY - static_cast<uint32_t>(bytes)) {
+			return SpiFlashErrorInputValue;
+		}
+		writes++;
+		while (bytes > 0) {
+			const uint32_t pageBase = offset - (offset % PAGE_SIZE);
+			size_t length = PAGE_SIZE - (offset - pageBase);
+			length = (bytes < length) ? bytes : length;
+			int result = SpiFlashErrorSuccess;
+			if (base != INVALID && base != pageBase) {
+				result = flush();
+			}
+			if (!result && base == INVALID && length == PAGE_SIZE) {
+				result = flash.write(data, offset, length);
+				if (!result) {
+					programs++;
+				}
+			} else if (!result) {
+				merge(data, offset, length);
+				if (count == PAGE_SIZE) {
+					result = flush();
+				}
+			}
+			if (result) {
+				return result;
+			}
+			data += length;
+			offset += length;
+			bytes -= length;
+		}
+		return SpiFlashErrorSuccess;
+	}
+	//! Reads from flash, programming the buffered page first if it overlaps.
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int read(uint8_t* /*[out]*/ data, uint32_t offset, size_t bytes) {
+		if (overlaps(offset, bytes)) {
+			int result = flush();
+			if (result) {
+				return result;
+			}
+		}
+		return flash.read(data, offset, bytes);
+	}
+	//! Erases flash. A buffered page inside the range is dropped once the
+	//! erase succeeded since its contents are erased anyway.
+	//! \returns SpiFlashErrorSuccess or non-zero if any error.
+	int erase(uint32_t offset, size_t bytes) {
+		if (overlaps(offset, bytes)) {
+			if (base >= offset && (base + PAGE_SIZE) <= (offset + bytes)) {
+				int result = flash.erase(offset, bytes);
+				if (!result) {
+					clear();
+				}
+				return result;
+			}
+			int result = flush();
+			if (result) {
+				return result;
+			}
+		}
+		return flash.erase(offset, bytes);
+	}
+	//! Calls of write().
+	uint32_t getWrites(void) const {
+		return writes;
+	}
+	//! Page programs issued.
+	uint32_t getPrograms(void) const {
+		return programs;
+	}
+	void resetCounters(void) {
+		writes = 0;
+		programs = 0;
+	}
+};
+
+#endif // SPI_FLASH_WRITE_BUFFER_H
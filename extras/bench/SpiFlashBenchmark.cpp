@@ -0,0 +1,307 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Benchmarks of SpiFlash against the simulator. Besides the host CPU time per
+// operation each benchmark reports the modeled device time (device_us/op) and
+// throughput (device_MB/s) on SimClock, which are deterministic and comparable
+// between runs and machines.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "SpiFlash.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+
+namespace {
+
+const uint32_t FLASH_SIZE = 0x1000000ul; // 16M, W25Q128.
+
+typedef SimSpiDevice<FLASH_SIZE, SpiFlashTimingW25Q, SimClock> Device;
+typedef SpiFlashWaitBackoff<SimClock> Wait;
+
+template<typename ReadMode>
+struct Flash {
+	typedef SpiFlash<Device, FLASH_SIZE, ReadMode, SpiFlashAddress3Byte, Wait>
+		Type;
+};
+
+typedef Flash<SpiFlashReadNormal>::Type NormalFlash;
+
+//! Deterministic offsets for the random access benchmarks.
+class Random {
+	uint32_t state;
+public:
+	Random() : state(0x2545F491ul) {
+	}
+	uint32_t next(void) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+};
+
+//! Starts device time measurement after the setup of a benchmark.
+void startDevice(void) {
+	SimClock::reset();
+}
+
+//! Reports device time per operation and throughput.
+void reportDevice(benchmark::State& state, uint64_t bytes) {
+	const double seconds = SimClock::getSeconds();
+	const double iterations = static_cast<double>(state.iterations());
+	state.counters["device_us/op"] = seconds * 1e6 / iterations;
+	state.counters["device_MB/s"] = (seconds > 0) ? (bytes / seconds / 1e6) : 0;
+	state.SetBytesProcessed(bytes);
+}
+
+template<typename Flash>
+void BM_SequentialRead(benchmark::State& state) {
+	Flash flash;
+	flash.init();
+	const size_t size = state.range(0);
+	std::vector<uint8_t> buffer(size);
+	uint32_t offset = 0;
+	startDevice();
+	for (auto _ : state) {
+		if (offset + size > FLASH_SIZE) {
+			offset = 0;
+		}
+		benchmark::DoNotOptimize(flash.read(&buffer[0], offset, size));
+		offset += size;
+	}
+	reportDevice(state, state.iterations() * size);
+}
+
+template<typename Flash>
+void BM_RandomRead(benchmark::State& state) {
+	Flash flash;
+	flash.init();
+	const size_t size = state.range(0);
+	std::vector<uint8_t> buffer(size);
+	Random random;
+	startDevice();
+	for (auto _ : state) {
+		const uint32_t offset = random.next() % (FLASH_SIZE - size);
+		benchmark::DoNotOptimize(flash.read(&buffer[0], offset, size));
+	}
+	reportDevice(state, state.iterations() * size);
+}
+
+//! Writes of range(0) bytes, page aligned or starting range(1) bytes into a
+//! page. Programming cells again is harmless in the simulator, so the flash
+//! is not erased in between.
+void BM_Write(benchmark::State& state) {
+	NormalFlash flash;
+	flash.init();
+	const size_t size = state.range(0);
+	const uint32_t skew = state.range(1);
+	std::vector<uint8_t> buffer(size, 0x5A);
+	uint32_t offset = 0;
+	startDevice();
+	for (auto _ : state) {
+		if (offset + skew + size > FLASH_SIZE) {
+			offset = 0;
+		}
+		benchmark::DoNotOptimize(flash.write(&buffer[0], offset + skew, size));
+		offset += (size + 255) & ~255ul;
+	}
+	reportDevice(state, state.iterations() * size);
+}
+
+//! Writes of a 64k sparse image where one page in range(0) holds data and the
+//! other pages are left 0xFF, like padding in a firmware image.
+void BM_WriteSparse(benchmark::State& state) {
+	NormalFlash flash;
+	flash.init();
+	const size_t size = 0x10000;
+	const size_t every = state.range(0);
+	std::vector<uint8_t> buffer(size, 0xFF);
+	for (size_t page = 0; page < size; page += every * 256) {
+		std::fill(&buffer[page + 16], &buffer[page + 240], 0x5A);
+	}
+	uint32_t offset = 0;
+	startDevice();
+	for (auto _ : state) {
+		if (offset + size > FLASH_SIZE) {
+			offset = 0;
+		}
+		benchmark::DoNotOptimize(flash.write(&buffer[0], offset, size));
+		offset += size;
+	}
+	reportDevice(state, state.iterations() * size);
+}
+
+//! Verified writes of range(0) bytes, each page read back after programming.
+void BM_WriteVerify(benchmark::State& state) {
+	NormalFlash flash;
+	flash.init();
+	const size_t size = state.range(0);
+	std::vector<uint8_t> buffer(size, 0x5A);
+	uint32_t offset = 0;
+	startDevice();
+	for (auto _ : state) {
+		if (offset + size > FLASH_SIZE) {
+			offset = 0;
+		}
+		benchmark::DoNotOptimize(flash.write(&buffer[0], offset, size,
+			SpiFlashWriteVerify));
+		offset += (size + 255) & ~255ul;
+	}
+	reportDevice(state, state.iterations() * size);
+}
+
+//! Flag style update() of one byte: clearing one bit of fresh bytes
+//! (range(0) = 0) programs in place, toggling the bit of one byte
+//! (range(0) = 1) rewrites the sector on every other update.
+void BM_Update(benchmark::State& state) {
+	NormalFlash flash;
+	flash.init();
+	const bool set = state.range(0);
+	uint8_t value = 0xFE;
+	uint32_t offset = 0;
+	startDevice();
+	for (auto _ : state) {
+		if (set) {
+			value ^= 0x01;
+		} else {
+			offset = (offset + 1) % FLASH_SIZE;
+		}
+		benchmark::DoNotOptimize(flash.update(&value, offset, 1));
+	}
+	reportDevice(state, state.iterations());
+}
+
+//! Erases of range(0) bytes at sector aligned offsets, the planner picks the
+//! erase commands.
+void BM_Erase(benchmark::State& state) {
+	NormalFlash flash;
+	flash.init();
+	const size_t size = state.range(0);
+	uint32_t offset = 0;
+	startDevice();
+	for (auto _ : state) {
+		if (offset + size > FLASH_SIZE) {
+			offset = 0;
+		}
+		benchmark::DoNotOptimize(flash.erase(offset, size));
+		offset += size;
+	}
+	reportDevice(state, state.iterations() * size);
+}
+
+//! Erases of range(0) bytes with the blank check on a flash where one in
+//! range(1) sectors holds data, the others are skipped.
+void BM_EraseBlankCheck(benchmark::State& state) {
+	NormalFlash flash;
+	flash.init();
+	const size_t size = state.range(0);
+	const uint32_t every = state.range(1);
+	const uint8_t programmed = 0x00;
+	uint32_t offset = 0;
+	uint64_t skipped = 0;
+	startDevice();
+	for (auto _ : state) {
+		state.PauseTiming();
+		if (offset + size > FLASH_SIZE) {
+			offset = 0;
+		}
+		for (uint32_t sector = 0; sector < size; sector += 4096 * every) {
+			flash.device().load(offset + sector, &programmed, 1);
+		}
+		state.ResumeTiming();
+		SpiFlashErasePlan plan;
+		benchmark::DoNotOptimize(
+			flash.erase(offset, size, &plan, SpiFlashEraseBlankCheck));
+		skipped += plan.skipped;
+		offset += size;
+	}
+	state.counters["skipped/op"] =
+		static_cast<double>(skipped) / state.iterations();
+	reportDevice(state, state.iterations() * size);
+}
+
+//! A 64k block erase started with beginErase() while range(0) byte reads of
+//! other blocks suspend it, as a foreground task would.
+void BM_MixedReadErase(benchmark::State& state) {
+	NormalFlash flash;
+	flash.init();
+	const size_t size = state.range(0);
+	std::vector<uint8_t> buffer(size);
+	Random random;
+	uint32_t offset = 0;
+	uint64_t reads = 0;
+	startDevice();
+	for (auto _ : state) {
+		flash.beginErase(offset, 0x10000);
+		while (flash.poll() == SpiFlashErrorBusy) {
+			const uint32_t from = 0x800000ul + random.next() % 0x7F0000ul;
+			benchmark::DoNotOptimize(flash.read(&buffer[0], from, size));
+			reads++;
+		}
+		offset = (offset + 0x10000) % 0x800000ul;
+	}
+	state.counters["reads/erase"] =
+		static_cast<double>(reads) / state.iterations();
+	reportDevice(state, state.iterations() * 0x10000ull);
+}
+
+} // namespace
+
+BENCHMARK_TEMPLATE(BM_SequentialRead, Flash<SpiFlashReadNormal>::Type)
+	->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_SequentialRead, Flash<SpiFlashReadFast>::Type)
+	->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_SequentialRead, Flash<SpiFlashReadDualIO>::Type)
+	->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_SequentialRead, Flash<SpiFlashReadQuadIO>::Type)
+	->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_SequentialRead,
+	Flash<SpiFlashReadQuadIOContinuous>::Type)
+	->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+BENCHMARK_TEMPLATE(BM_RandomRead, Flash<SpiFlashReadNormal>::Type)
+	->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_RandomRead, Flash<SpiFlashReadQuadIO>::Type)
+	->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_RandomRead, Flash<SpiFlashReadQuadIOContinuous>::Type)
+	->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(BM_Write)->ArgNames({"bytes", "skew"})
+	->Args({16, 0})->Args({256, 0})->Args({4096, 0})
+	->Args({256, 13})->Args({4096, 13});
+BENCHMARK(BM_WriteSparse)->ArgName("every")->Arg(1)->Arg(4)->Arg(16);
+BENCHMARK(BM_WriteVerify)->Arg(256)->Arg(4096);
+BENCHMARK(BM_Update)->ArgName("set")->Arg(0)->Arg(1);
+BENCHMARK(BM_Erase)->Arg(0x1000)->Arg(0x8000)->Arg(0x10000)->Arg(0x40000);
+BENCHMARK(BM_EraseBlankCheck)->ArgNames({"bytes", "every"})
+	->Args({0x10000, 1})->Args({0x10000, 16})->Args({0x40000, 8});
+BENCHMARK(BM_MixedReadErase)->Arg(256)->Arg(4096);
+
+BENCHMARK_MAIN();
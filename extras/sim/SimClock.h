@@ -0,0 +1,66 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+#ifndef SIM_CLOCK_H
+#define SIM_CLOCK_H
+
+#include <stdint.h>
+
+//! Virtual time source for the Clock parameter of the wait strategies, e.g.
+//! SpiFlashWaitSpin<SimClock>, and of SimSpiDevice. Time only passes when
+//! SimSpiDevice clocks the bus, when the driver sleeps or yields, so BUSY
+//! durations and transfers are measured in deterministic device time instead
+//! of host CPU time. All users share one timeline.
+struct SimClock {
+	//! Microseconds since the last reset().
+	static uint32_t now(void) {
+		return static_cast<uint32_t>(picoseconds() / 1000000ull);
+	}
+	static void sleep(uint32_t us) {
+		picoseconds() += us * 1000000ull;
+	}
+	//! Nothing else runs, let a microsecond pass so timeouts expire.
+	static void yield(void) {
+		sleep(1);
+	}
+	static void advance(uint64_t ps) {
+		picoseconds() += ps;
+	}
+	//! Device time since the last reset().
+	static double getSeconds(void) {
+		return static_cast<double>(picoseconds()) / 1e12;
+	}
+	static void reset(void) {
+		picoseconds() = 0;
+	}
+
+private:
+	static uint64_t& picoseconds(void) {
+		static uint64_t time = 0;
+		return time;
+	}
+};
+
+#endif // SIM_CLOCK_H
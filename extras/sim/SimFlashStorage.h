@@ -0,0 +1,222 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+#ifndef SIM_FLASH_STORAGE_H
+#define SIM_FLASH_STORAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+//! Sparse contents of a simulated flash. Only sectors holding programmed bytes
+//! are stored, in a two level radix tree of 4k sectors below 1M tables; erased
+//! sectors are implicit. Tables and sectors are shared copy-on-write, so
+//! snapshot() and restore() are O(1) regardless of how much is stored.
+template<uint32_t FLASH_SIZE>
+class SimFlashStorage {
+public:
+	enum {
+		SECTOR_SIZE = 4096,
+		TABLE_SECTORS = 256,
+		SECTORS = (FLASH_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE,
+		TABLES = (SECTORS + TABLE_SECTORS - 1) / TABLE_SECTORS
+	};
+
+private:
+	struct Sector {
+		uint8_t bytes[SECTOR_SIZE];
+	};
+	struct Table {
+		std::shared_ptr<Sector> sectors[TABLE_SECTORS];
+	};
+	struct Directory {
+		std::vector<std::shared_ptr<Table> > tables;
+		//! Stored sectors.
+		size_t sectors;
+		Directory() : tables(TABLES), sectors(0) {
+		}
+	};
+
+	std::shared_ptr<Directory> directory;
+
+	//! Takes a private copy of node if it is shared with a snapshot.
+	template<typename Node>
+	static void own(std::shared_ptr<Node>& node) {
+		if (node.use_count() > 1) {
+			node = std::make_shared<Node>(*node);
+		}
+	}
+
+	//! Stored sector or 0 if it is erased.
+	const uint8_t* find(uint32_t sector) const {
+		const std::shared_ptr<Table>& table =
+			directory->tables[sector / TABLE_SECTORS];
+		if (!table) {
+			return 0;
+		}
+		const std::shared_ptr<Sector>& stored =
+			table->sectors[sector % TABLE_SECTORS];
+		return stored ? stored->bytes : 0;
+	}
+
+	//! Sector for modification, allocated erased if not stored.
+	uint8_t* modify(uint32_t sector) {
+		own(directory);
+		std::shared_ptr<Table>& table =
+			directory->tables[sector / TABLE_SECTORS];
+		if (!table) {
+			table = std::make_shared<Table>();
+		} else {
+			own(table);
+		}
+		std::shared_ptr<Sector>& stored =
+			table->sectors[sector % TABLE_SECTORS];
+		if (!stored) {
+			stored = std::make_shared<Sector>();
+			memset(stored->bytes, 0xFF, SECTOR_SIZE);
+			directory->sectors++;
+		} else {
+			own(stored);
+		}
+		return stored->bytes;
+	}
+
+	void drop(uint32_t sector) {
+		if (!find(sector)) {
+			return;
+		}
+		own(directory);
+		std::shared_ptr<Table>& table =
+			directory->tables[sector / TABLE_SECTORS];
+		own(table);
+		table->sectors[sector % TABLE_SECTORS].reset();
+		directory->sectors--;
+	}
+
+	static bool isErased(const uint8_t* data, size_t length) {
+		for (size_t i = 0; i < length; i++) {
+			if (data[i] != 0xFF) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//! Calls apply(sector, column, position, length) for each sector piece of
+	//! [offset, offset + length), wrapping at the end of the flash.
+	template<typename Apply>
+	static void forEach(uint32_t offset, size_t length, Apply apply) {
+		size_t position = 0;
+		offset %= FLASH_SIZE;
+		while (position < length) {
+			const uint32_t column = offset % SECTOR_SIZE;
+			size_t piece = SECTOR_SIZE - column;
+			if (piece > FLASH_SIZE - offset) {
+				piece = FLASH_SIZE - offset;
+			}
+			if (piece > length - position) {
+				piece = length - position;
+			}
+			apply(offset / SECTOR_SIZE, column, position, piece);
+			position += piece;
+			offset = (offset + piece) % FLASH_SIZE;
+		}
+	}
+
+public:
+	//! Flash image shared with the storage it was taken from.
+	typedef std::shared_ptr<const Directory> Snapshot;
+
+	SimFlashStorage() : directory(std::make_shared<Directory>()) {
+	}
+
+	void read(uint32_t offset, uint8_t* data, size_t length) const {
+		forEach(offset, length, [this, data](uint32_t sector, uint32_t column,
+				size_t position, size_t piece) {
+			const uint8_t* stored = find(sector);
+			if (stored) {
+				memcpy(&data[position], &stored[column], piece);
+			} else {
+				memset(&data[position], 0xFF, piece);
+			}
+		});
+	}
+
+	//! Replaces bytes, as if erased and programmed.
+	void write(uint32_t offset, const uint8_t* data, size_t length) {
+		forEach(offset, length, [this, data](uint32_t sector, uint32_t column,
+				size_t position, size_t piece) {
+			if (!find(sector) && isErased(&data[position], piece)) {
+				return;
+			}
+			memcpy(&modify(sector)[column], &data[position], piece);
+		});
+	}
+
+	//! ANDs data into the flash like a page program.
+	void program(uint32_t offset, const uint8_t* data, size_t length) {
+		forEach(offset, length, [this, data](uint32_t sector, uint32_t column,
+				size_t position, size_t piece) {
+			if (isErased(&data[position], piece)) {
+				return;
+			}
+			uint8_t* bytes = &modify(sector)[column];
+			for (size_t i = 0; i < piece; i++) {
+				bytes[i] &= data[position + i];
+			}
+		});
+	}
+
+	//! Sets whole sectors of [offset, offset + length) to 0xFF.
+	void erase(uint32_t offset, size_t length) {
+		if (offset == 0 && length >= FLASH_SIZE) {
+			directory = std::make_shared<Directory>();
+			return;
+		}
+		forEach(offset, length, [this](uint32_t sector, uint32_t,
+				size_t, size_t) {
+			drop(sector);
+		});
+	}
+
+	Snapshot snapshot(void) const {
+		return directory;
+	}
+
+	//! Returns to a snapshot, which stays valid for further restores.
+	void restore(const Snapshot& image) {
+		directory = std::const_pointer_cast<Directory>(image);
+	}
+
+	//! Sectors stored by the current image.
+	size_t getSectors(void) const {
+		return directory->sectors;
+	}
+};
+
+#endif // SIM_FLASH_STORAGE_H
@@ -0,0 +1,736 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef SIM_SPI_DEVICE_H
+#define SIM_SPI_DEVICE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#include "../../SpiFlash.h"
+#include "SimClock.h"
+#include "SimFlashStorage.h"
+
+//! Host-side SpiDevice simulating a W25Q flash. Implements the single lane
+//! SpiDevice concept as well as the transferIn() and transferLanes()
+//! extensions. Multi-lane phases are serialized into per-clock lane samples
+//! and reassembled like a controller would, so the byte ordering of every mode
+//! can be verified against the flash contents. Continuous read mode is
+//! tracked, any transaction the flash would misinterpret is counted as a
+//! protocol error. Each transaction is accounted in SPI clocks to model the
+//! bus throughput.
+//!
+//! Programs and erases follow NOR semantics: a page program ANDs its data into
+//! the page, wrapping at the 256 byte page boundary, an erase sets the sector,
+//! block or chip to 0xFF. Both need the write enable latch, which is cleared
+//! when they complete. They keep BUSY set for the typical duration given by
+//! Timing, measured on Clock, and take effect when BUSY clears; an erase or
+//! program can be suspended (0x75) and resumed (0x7A). While BUSY only status
+//! reads and suspend are decoded, in power-down only the release (0xAB).
+//! Everything else is ignored and counted as a protocol error.
+//!
+//! Contents are kept in SimFlashStorage, so large parts only cost memory for
+//! programmed sectors and can be snapshot and restored in O(1).
+//!
+//! With Clock = SimClock, every transfer advances the virtual clock by its SPI
+//! clocks at setClock() speed, so waits, BUSY durations and transfers all run
+//! on reproducible device time.
+template<uint32_t FLASH_SIZE = 0x80000ul /*512k*/,
+	typename Timing = SpiFlashTimingW25Q, typename Clock = SpiFlashClock>
+class SimSpiDevice {
+
+	enum {
+		CMD_WRITE_STATUS_REGISTER = 0x01,
+		CMD_PAGE_PROGRAM = 0x02,
+		CMD_READ_DATA = 0x03,
+		CMD_WRITE_DISABLE = 0x04,
+		CMD_READ_STATUS_REGISTER = 0x05,
+		CMD_WRITE_ENABLE = 0x06,
+		CMD_FAST_READ = 0x0B,
+		CMD_SECTOR_ERASE_4K = 0x20,
+		CMD_READ_STATUS_REGISTER_2 = 0x35,
+		CMD_READ_UNIQUE_ID = 0x4B,
+		CMD_BLOCK_ERASE_32K = 0x52,
+		CMD_CHIP_ERASE_ALT = 0x60,
+		CMD_ERASE_PROGRAM_SUSPEND = 0x75,
+		CMD_ERASE_PROGRAM_RESUME = 0x7A,
+		CMD_JEDEC_ID = 0x9F,
+		CMD_RELEASE_POWER_DOWN = 0xAB,
+		CMD_POWER_DOWN = 0xB9,
+		CMD_CHIP_ERASE = 0xC7,
+		CMD_BLOCK_ERASE_64K = 0xD8,
+		CMD_FAST_READ_DUAL_OUTPUT = 0x3B,
+		CMD_FAST_READ_QUAD_OUTPUT = 0x6B,
+		CMD_FAST_READ_DUAL_IO = 0xBB,
+		CMD_FAST_READ_QUAD_IO = 0xEB,
+		CMD_READ_DATA_4BYTE = 0x13,
+		CMD_FAST_READ_4BYTE = 0x0C,
+		CMD_FAST_READ_DUAL_OUTPUT_4BYTE = 0x3C,
+		CMD_FAST_READ_QUAD_OUTPUT_4BYTE = 0x6C,
+		CMD_FAST_READ_DUAL_IO_4BYTE = 0xBC,
+		CMD_FAST_READ_QUAD_IO_4BYTE = 0xEC,
+		CMD_PAGE_PROGRAM_4BYTE = 0x12,
+		CMD_SECTOR_ERASE_4K_4BYTE = 0x21,
+		CMD_BLOCK_ERASE_64K_4BYTE = 0xDC,
+		CMD_ENTER_4BYTE_ADDRESS_MODE = 0xB7,
+		CMD_EXIT_4BYTE_ADDRESS_MODE = 0xE9,
+		REG_STATUS_REGISTER_BUSY = (1 << 0),
+		REG_STATUS_REGISTER_WEL = (1 << 1),
+		REG_STATUS_REGISTER_WRITABLE = 0xFC,
+		REG_STATUS_REGISTER_2_QE = (1 << 1),
+		REG_STATUS_REGISTER_2_SUS = (1 << 7),
+		REG_STATUS_REGISTER_2_WRITABLE = 0x7F,
+		MANUFACTURER_WINBOND = 0xEF,
+		MEMORY_TYPE_W25Q = 0x40,
+		PAGE_SIZE = 256,
+		CMD_CONTINUOUS_READ_MODE_RESET = 0xFF,
+		MODE_CONTINUOUS_READ_MASK = 0x30,
+		MODE_CONTINUOUS_READ = 0x20,
+	};
+
+	SimFlashStorage<FLASH_SIZE> memory;
+	//! Non-volatile bits of the status registers, BUSY, WEL and SUS are
+	//! derived from the state below.
+	uint8_t status;
+	uint8_t status2;
+	bool isWriteEnabled;
+	bool isPoweredDown;
+	//! When the power-down was released, commands need tRES1 to pass.
+	bool isReleasing;
+	uint32_t releasedAt;
+	//! Program or erase in flight, its start and what it changes.
+	SpiFlashOperation operation;
+	uint32_t operationStart;
+	uint32_t operationOffset;
+	uint32_t operationSize;
+	uint8_t page[PAGE_SIZE];
+	bool isSuspended;
+	uint32_t suspendedAt;
+	uint64_t uniqueId;
+	uint64_t programs;
+	uint64_t erases;
+	uint32_t clockHz;
+	uint64_t clocks;
+	uint64_t transactions;
+	uint64_t protocolErrors;
+	//! Command of the armed continuous read, 0 if not armed.
+	uint8_t continuousCommand;
+	bool isAddressMode4Byte;
+
+	//! Splits bytes into samples of lanes bits, MSB first.
+	static void toLanes(const uint8_t* bytes, size_t length, uint8_t lanes,
+			std::vector<uint8_t>& samples) {
+		const uint8_t mask = (1 << lanes) - 1;
+		samples.clear();
+		for (size_t i = 0; i < length; i++) {
+			for (int shift = 8 - lanes; shift >= 0; shift -= lanes) {
+				samples.push_back((bytes[i] >> shift) & mask);
+			}
+		}
+	}
+
+	//! Reassembles bytes from samples of lanes bits, MSB first.
+	static void fromLanes(const std::vector<uint8_t>& samples, uint8_t lanes,
+			uint8_t* bytes) {
+		const size_t perByte = 8 / lanes;
+		for (size_t i = 0; i < samples.size() / perByte; i++) {
+			uint8_t value = 0;
+			for (size_t j = 0; j < perByte; j++) {
+				value = (value << lanes) | samples[i * perByte + j];
+			}
+			bytes[i] = value;
+		}
+	}
+
+	static bool isValidLanes(uint8_t lanes) {
+		return lanes == 1 || lanes == 2 || lanes == 4;
+	}
+
+	//! Time passes on SimClock only, other clocks run on their own.
+	static void advance(SimClock*, uint64_t ps) {
+		SimClock::advance(ps);
+	}
+
+	static void advance(void*, uint64_t) {
+	}
+
+	//! Accounts SPI clocks of a transfer.
+	void spend(uint64_t count) {
+		clocks += count;
+		advance(static_cast<Clock*>(0),
+			static_cast<uint64_t>(count * 1e12 / clockHz));
+	}
+
+	//! JEDEC capacity code, log2 of the size in bytes.
+	static uint8_t capacityCode(void) {
+		uint8_t code = 0;
+		while ((1ul << code) < FLASH_SIZE) {
+			code++;
+		}
+		return code;
+	}
+
+	//! Applies the program or erase in flight once its duration has passed.
+	void complete(void) {
+		if (operation == SpiFlashOperationNone || isSuspended ||
+				(Clock::now() - operationStart) < Timing::typical(operation)) {
+			return;
+		}
+		if (operation == SpiFlashOperationPageProgram) {
+			memory.program(operationOffset, page, PAGE_SIZE);
+		} else if (operation != SpiFlashOperationWriteStatus) {
+			memory.erase(operationOffset, operationSize);
+		}
+		operation = SpiFlashOperationNone;
+		isWriteEnabled = false;
+	}
+
+	//! BUSY is set while an operation runs and until a suspend took effect.
+	bool isBusyNow(void) const {
+		if (isSuspended) {
+			return (Clock::now() - suspendedAt) <
+				Timing::typical(SpiFlashOperationSuspend);
+		}
+		return operation != SpiFlashOperationNone;
+	}
+
+	//! Whether the flash decodes command in its current state, counts a
+	//! protocol error otherwise.
+	bool isReady(uint8_t command) {
+		complete();
+		bool ready = true;
+		if (isReleasing && (Clock::now() - releasedAt) >=
+				Timing::typical(SpiFlashOperationReleasePowerDown)) {
+			isReleasing = false;
+		}
+		if (isPoweredDown) {
+			ready = command == CMD_RELEASE_POWER_DOWN;
+		} else if (isReleasing) {
+			ready = false;
+		} else if (isBusyNow()) {
+			ready = command == CMD_READ_STATUS_REGISTER ||
+				command == CMD_READ_STATUS_REGISTER_2 ||
+				command == CMD_ERASE_PROGRAM_SUSPEND;
+		}
+		if (!ready) {
+			protocolErrors++;
+		}
+		return ready;
+	}
+
+	//! Only a mode reset is understood while continuous read is armed.
+	bool accept(uint8_t command) {
+		if (continuousCommand) {
+			protocolErrors++;
+			return false;
+		}
+		return isReady(command);
+	}
+
+	//! Starts a program, erase or status write, which needs the write enable
+	//! latch and can not be issued while another one is suspended.
+	bool start(SpiFlashOperation started, uint32_t offset, uint32_t size) {
+		if (isSuspended) {
+			protocolErrors++;
+			return false;
+		}
+		if (!isWriteEnabled) {
+			return false;
+		}
+		operation = started;
+		operationStart = Clock::now();
+		operationOffset = offset;
+		operationSize = size;
+		return true;
+	}
+
+	void programPage(const uint8_t* buffer, size_t length) {
+		const size_t address = addressBytes(buffer[0]);
+		if (length <= 1 + address) {
+			return;
+		}
+		const uint32_t offset = decodeAddress(&buffer[1], address) % FLASH_SIZE;
+		if (!start(SpiFlashOperationPageProgram,
+				offset & ~(PAGE_SIZE - 1ul), PAGE_SIZE)) {
+			return;
+		}
+		memset(page, 0xFF, sizeof(page));
+		// Only the last page size bytes clocked in are kept.
+		const uint8_t* data = &buffer[1 + address];
+		size_t bytes = length - 1 - address;
+		size_t column = offset % PAGE_SIZE;
+		if (bytes > PAGE_SIZE) {
+			column = (column + bytes - PAGE_SIZE) % PAGE_SIZE;
+			data += bytes - PAGE_SIZE;
+			bytes = PAGE_SIZE;
+		}
+		for (size_t i = 0; i < bytes; i++) {
+			page[(column + i) % PAGE_SIZE] &= data[i];
+		}
+		programs++;
+	}
+
+	void eraseBlock(const uint8_t* buffer, size_t length,
+			SpiFlashOperation block, uint32_t size) {
+		const size_t address = addressBytes(buffer[0]);
+		if (length < 1 + address) {
+			return;
+		}
+		const uint32_t offset = decodeAddress(&buffer[1], address) % FLASH_SIZE;
+		if (start(block, offset & ~(size - 1), size)) {
+			erases++;
+		}
+	}
+
+	void eraseChip(void) {
+		if (start(SpiFlashOperationChipErase, 0, FLASH_SIZE)) {
+			erases++;
+		}
+	}
+
+	void writeStatus(const uint8_t* values, size_t length) {
+		if (length == 0 || !start(SpiFlashOperationWriteStatus, 0, 0)) {
+			return;
+		}
+		status = values[0] & REG_STATUS_REGISTER_WRITABLE;
+		if (length > 1) {
+			status2 = values[1] & REG_STATUS_REGISTER_2_WRITABLE;
+		}
+	}
+
+	void suspend(void) {
+		if (isSuspended || (operation != SpiFlashOperationPageProgram &&
+				operation != SpiFlashOperationSectorErase &&
+				operation != SpiFlashOperationBlockErase32K &&
+				operation != SpiFlashOperationBlockErase64K)) {
+			return;
+		}
+		isSuspended = true;
+		suspendedAt = Clock::now();
+	}
+
+	void resume(void) {
+		if (!isSuspended) {
+			return;
+		}
+		isSuspended = false;
+		operationStart += Clock::now() - suspendedAt;
+	}
+
+	//! Maps the 4-byte address opcodes to their 3-byte counterparts.
+	static uint8_t baseCommand(uint8_t command) {
+		switch (command) {
+		case CMD_PAGE_PROGRAM_4BYTE: return CMD_PAGE_PROGRAM;
+		case CMD_SECTOR_ERASE_4K_4BYTE: return CMD_SECTOR_ERASE_4K;
+		case CMD_BLOCK_ERASE_64K_4BYTE: return CMD_BLOCK_ERASE_64K;
+		case CMD_READ_DATA_4BYTE: return CMD_READ_DATA;
+		case CMD_FAST_READ_4BYTE: return CMD_FAST_READ;
+		case CMD_FAST_READ_DUAL_OUTPUT_4BYTE: return CMD_FAST_READ_DUAL_OUTPUT;
+		case CMD_FAST_READ_QUAD_OUTPUT_4BYTE: return CMD_FAST_READ_QUAD_OUTPUT;
+		case CMD_FAST_READ_DUAL_IO_4BYTE: return CMD_FAST_READ_DUAL_IO;
+		case CMD_FAST_READ_QUAD_IO_4BYTE: return CMD_FAST_READ_QUAD_IO;
+		default: return command;
+		}
+	}
+
+	//! Address length of command in the current address mode.
+	size_t addressBytes(uint8_t command) const {
+		return (isAddressMode4Byte || baseCommand(command) != command) ? 4 : 3;
+	}
+
+	static uint32_t decodeAddress(const uint8_t* address, size_t length) {
+		uint32_t offset = 0;
+		for (size_t i = 0; i < length; i++) {
+			offset = (offset << 8) | address[i];
+		}
+		return offset;
+	}
+
+	void readMemory(uint32_t offset, uint8_t* data, size_t length) const {
+		memory.read(offset, data, length);
+	}
+
+	//! Lane layout the flash expects for a read command.
+	bool readLayout(uint8_t command, uint8_t& addressLanes, uint8_t& modeBytes,
+			uint8_t& dummyClocks, uint8_t& dataLanes) const {
+		const bool quad = status2 & REG_STATUS_REGISTER_2_QE;
+		switch (baseCommand(command)) {
+		case CMD_READ_DATA:
+			addressLanes = 1; modeBytes = 0; dummyClocks = 0; dataLanes = 1;
+			return true;
+		case CMD_FAST_READ:
+			addressLanes = 1; modeBytes = 0; dummyClocks = 8; dataLanes = 1;
+			return true;
+		case CMD_FAST_READ_DUAL_OUTPUT:
+			addressLanes = 1; modeBytes = 0; dummyClocks = 8; dataLanes = 2;
+			return true;
+		case CMD_FAST_READ_QUAD_OUTPUT:
+			addressLanes = 1; modeBytes = 0; dummyClocks = 8; dataLanes = 4;
+			return quad;
+		case CMD_FAST_READ_DUAL_IO:
+			addressLanes = 2; modeBytes = 1; dummyClocks = 0; dataLanes = 2;
+			return true;
+		case CMD_FAST_READ_QUAD_IO:
+			addressLanes = 4; modeBytes = 1; dummyClocks = 4; dataLanes = 4;
+			return quad;
+		default:
+			return false;
+		}
+	}
+
+public:
+	SimSpiDevice() : status(0), status2(0),
+			isWriteEnabled(false), isPoweredDown(false),
+			isReleasing(false), releasedAt(0),
+			operation(SpiFlashOperationNone), operationStart(0),
+			operationOffset(0), operationSize(0), isSuspended(false),
+			suspendedAt(0), uniqueId(0xEF4017A5C3E1D2B0ull), programs(0),
+			erases(0), clockHz(50000000ul), clocks(0), transactions(0),
+			protocolErrors(0), continuousCommand(0),
+			isAddressMode4Byte(false) {
+	}
+
+	void master(void) {
+	}
+
+	uint8_t transfer(uint8_t data) {
+		transactions++;
+		spend(8);
+		if (data == CMD_CONTINUOUS_READ_MODE_RESET) {
+			continuousCommand = 0;
+			return 0xFF;
+		}
+		if (!accept(data)) {
+			return 0xFF;
+		}
+		switch (data) {
+		case CMD_WRITE_ENABLE:
+			isWriteEnabled = true;
+			break;
+		case CMD_WRITE_DISABLE:
+			isWriteEnabled = false;
+			break;
+		case CMD_CHIP_ERASE:
+		case CMD_CHIP_ERASE_ALT:
+			eraseChip();
+			break;
+		case CMD_ERASE_PROGRAM_SUSPEND:
+			suspend();
+			break;
+		case CMD_ERASE_PROGRAM_RESUME:
+			resume();
+			break;
+		case CMD_POWER_DOWN:
+			isPoweredDown = true;
+			break;
+		case CMD_RELEASE_POWER_DOWN:
+			isPoweredDown = false;
+			isReleasing = true;
+			releasedAt = Clock::now();
+			break;
+		case CMD_ENTER_4BYTE_ADDRESS_MODE:
+			isAddressMode4Byte = true;
+			break;
+		case CMD_EXIT_4BYTE_ADDRESS_MODE:
+			isAddressMode4Byte = false;
+			break;
+		default:
+			break;
+		}
+		return 0xFF;
+	}
+
+	void transferBulk(uint8_t* buffer, size_t length) {
+		transactions++;
+		spend(8 * length);
+		if (length == 0 || !accept(buffer[0])) {
+			return;
+		}
+		uint8_t addressLanes = 0, modeBytes = 0, dummyClocks = 0, dataLanes = 0;
+		switch (buffer[0]) {
+		case CMD_WRITE_STATUS_REGISTER:
+			writeStatus(&buffer[1], length - 1);
+			break;
+		case CMD_PAGE_PROGRAM:
+		case CMD_PAGE_PROGRAM_4BYTE:
+			programPage(buffer, length);
+			break;
+		case CMD_SECTOR_ERASE_4K:
+		case CMD_SECTOR_ERASE_4K_4BYTE:
+			eraseBlock(buffer, length, SpiFlashOperationSectorErase, 0x1000);
+			break;
+		case CMD_BLOCK_ERASE_32K:
+			eraseBlock(buffer, length, SpiFlashOperationBlockErase32K, 0x8000);
+			break;
+		case CMD_BLOCK_ERASE_64K:
+		case CMD_BLOCK_ERASE_64K_4BYTE:
+			eraseBlock(buffer, length, SpiFlashOperationBlockErase64K, 0x10000);
+			break;
+		case CMD_JEDEC_ID: {
+			const uint8_t id[] = {
+				MANUFACTURER_WINBOND, MEMORY_TYPE_W25Q, capacityCode()
+			};
+			for (size_t i = 1; i < length; i++) {
+				buffer[i] = (i <= sizeof(id)) ? id[i - 1] : 0xFF;
+			}
+			break;
+		}
+		case CMD_READ_UNIQUE_ID: {
+			// Dummy bytes as long as an address, plus one.
+			const size_t header = 1 + addressBytes(buffer[0]) + 1;
+			for (size_t i = header; i < length && i < header + 8; i++) {
+				buffer[i] = static_cast<uint8_t>(
+					uniqueId >> (8 * (header + 7 - i)));
+			}
+			break;
+		}
+		case CMD_RELEASE_POWER_DOWN:
+			// Three dummy bytes, then the device ID.
+			isPoweredDown = false;
+			isReleasing = true;
+			releasedAt = Clock::now();
+			for (size_t i = 4; i < length; i++) {
+				buffer[i] = capacityCode() - 1;
+			}
+			break;
+		case CMD_READ_DATA:
+		case CMD_FAST_READ:
+		case CMD_READ_DATA_4BYTE:
+		case CMD_FAST_READ_4BYTE: {
+			readLayout(buffer[0], addressLanes, modeBytes, dummyClocks,
+				dataLanes);
+			const size_t address = addressBytes(buffer[0]);
+			const size_t header = 1 + address + dummyClocks / 8;
+			if (length > header) {
+				readMemory(decodeAddress(&buffer[1], address), &buffer[header],
+					length - header);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	uint8_t transferRegister(uint8_t command, uint8_t value) {
+		transactions++;
+		spend(16);
+		if (!accept(command)) {
+			return 0xFF;
+		}
+		switch (command) {
+		case CMD_READ_STATUS_REGISTER:
+			return getStatus();
+		case CMD_READ_STATUS_REGISTER_2:
+			return getStatus2();
+		case CMD_WRITE_STATUS_REGISTER:
+			writeStatus(&value, 1);
+			return 0xFF;
+		default:
+			return 0xFF;
+		}
+	}
+
+	void transferIn(const uint8_t* header, size_t headerLength, uint8_t* data,
+			size_t length) {
+		transactions++;
+		spend(8 * (headerLength + length));
+		uint8_t addressLanes = 0, modeBytes = 0, dummyClocks = 0, dataLanes = 0;
+		if (headerLength == 0 || !accept(header[0]) ||
+				!readLayout(header[0], addressLanes, modeBytes, dummyClocks,
+					dataLanes) || dataLanes != 1 ||
+				headerLength != 1 + addressBytes(header[0]) + dummyClocks / 8) {
+			memset(data, 0xFF, length);
+			return;
+		}
+		readMemory(decodeAddress(&header[1], addressBytes(header[0])), data,
+			length);
+	}
+
+	void transferLanes(const SpiFlashLaneTransfer& transfer) {
+		transactions++;
+		// In continuous read mode the flash expects no command, without it a
+		// command is required.
+		if (transfer.skipCommand != (continuousCommand != 0)) {
+			protocolErrors++;
+			memset(transfer.data, 0xFF, transfer.length);
+			return;
+		}
+		const uint8_t command = transfer.skipCommand ?
+			continuousCommand : transfer.command;
+		if (!isReady(command)) {
+			memset(transfer.data, 0xFF, transfer.length);
+			return;
+		}
+		uint8_t addressLanes = 0, modeBytes = 0, dummyClocks = 0, dataLanes = 0;
+		if (!readLayout(command, addressLanes, modeBytes,
+				dummyClocks, dataLanes) ||
+				!isValidLanes(transfer.addressLanes) ||
+				!isValidLanes(transfer.dataLanes) ||
+				transfer.addressLanes != addressLanes ||
+				transfer.addressLength != addressBytes(command) + modeBytes ||
+				transfer.dummyClocks != dummyClocks ||
+				transfer.dataLanes != dataLanes) {
+			// Misframed transaction, the flash drives nothing.
+			protocolErrors++;
+			memset(transfer.data, 0xFF, transfer.length);
+			return;
+		}
+		// Address phase: controller drives the lanes, flash samples them.
+		std::vector<uint8_t> samples;
+		toLanes(transfer.address, transfer.addressLength, addressLanes,
+			samples);
+		uint8_t address[5];
+		fromLanes(samples, addressLanes, address);
+		const size_t addressLength = addressBytes(command);
+		spend((transfer.skipCommand ? 0 : 8) + samples.size() + dummyClocks);
+		// Mode bits M5-4 = 10 arm continuous read for the I/O commands.
+		const bool armed = modeBytes &&
+			(address[addressLength] & MODE_CONTINUOUS_READ_MASK) ==
+				MODE_CONTINUOUS_READ;
+		continuousCommand = armed ? command : 0;
+		// Data phase: flash drives the lanes, controller samples them.
+		std::vector<uint8_t> data(transfer.length);
+		readMemory(decodeAddress(address, addressLength), &data[0],
+			data.size());
+		toLanes(&data[0], data.size(), dataLanes, samples);
+		fromLanes(samples, dataLanes, transfer.data);
+		spend(samples.size());
+	}
+
+	typedef typename SimFlashStorage<FLASH_SIZE>::Snapshot Snapshot;
+
+	//! Preloads flash contents.
+	void load(uint32_t offset, const uint8_t* data, size_t length) {
+		memory.write(offset, data, length);
+	}
+
+	//! Copies flash contents, including a completed program or erase.
+	void contents(uint32_t offset, uint8_t* data, size_t length) {
+		complete();
+		memory.read(offset, data, length);
+	}
+
+	//! Captures the flash contents in O(1); unchanged sectors stay shared
+	//! between the snapshot and the device.
+	Snapshot snapshot(void) {
+		complete();
+		return memory.snapshot();
+	}
+
+	//! Returns the flash contents to a snapshot in O(1), e.g. to reset a
+	//! populated image between test cases.
+	void restore(const Snapshot& image) {
+		memory.restore(image);
+	}
+
+	//! 4k sectors stored for programmed data, erased ones take no memory.
+	size_t getStoredSectors(void) const {
+		return memory.getSectors();
+	}
+
+	//! Status register 1 as the flash reports it, with BUSY and WEL.
+	uint8_t getStatus(void) {
+		complete();
+		return status | (isBusyNow() ? REG_STATUS_REGISTER_BUSY : 0) |
+			(isWriteEnabled ? REG_STATUS_REGISTER_WEL : 0);
+	}
+
+	//! Status register 2 as the flash reports it, with SUS.
+	uint8_t getStatus2(void) {
+		complete();
+		return status2 | (isSuspended ? REG_STATUS_REGISTER_2_SUS : 0);
+	}
+
+	//! Whether a program or erase runs or is suspended. Its changes are not
+	//! visible in contents() until it completes.
+	bool isOperationPending(void) {
+		complete();
+		return operation != SpiFlashOperationNone;
+	}
+
+	bool isSleeping(void) const {
+		return isPoweredDown;
+	}
+
+	bool isWriteEnableLatched(void) const {
+		return isWriteEnabled;
+	}
+
+	void setUniqueId(uint64_t id) {
+		uniqueId = id;
+	}
+
+	//! Page programs and erases accepted since the last resetCounters().
+	uint64_t getPrograms(void) const {
+		return programs;
+	}
+
+	uint64_t getErases(void) const {
+		return erases;
+	}
+
+	//! SPI clock used for the throughput model.
+	void setClock(uint32_t hz) {
+		clockHz = hz;
+	}
+
+	//! SPI clocks spent since the last resetCounters().
+	uint64_t getClocks(void) const {
+		return clocks;
+	}
+
+	uint64_t getTransactions(void) const {
+		return transactions;
+	}
+
+	//! Transactions the flash would have misinterpreted: misframed
+	//! multi-lane reads and commands sent while in continuous read mode.
+	uint64_t getProtocolErrors(void) const {
+		return protocolErrors;
+	}
+
+	//! Whether the flash is in continuous read mode.
+	bool isContinuousRead(void) const {
+		return continuousCommand != 0;
+	}
+
+	//! Modeled bus time since the last resetCounters().
+	double getSeconds(void) const {
+		return static_cast<double>(clocks) / clockHz;
+	}
+
+	void resetCounters(void) {
+		clocks = 0;
+		transactions = 0;
+		protocolErrors = 0;
+		programs = 0;
+		erases = 0;
+	}
+};
+
+#endif // SIM_SPI_DEVICE_H
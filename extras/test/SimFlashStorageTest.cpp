@@ -0,0 +1,131 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks SimFlashStorage snapshots: writes after snapshot() do not leak into
+// it, restore() brings the old image back, and erased sectors read as 0xFF
+// without allocating. operator new is replaced by a counting one.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "extras/sim/SimFlashStorage.h"
+#include "SpiFlashTest.h"
+
+static bool isCounting = false;
+static unsigned long allocations = 0;
+
+void* operator new(size_t size) {
+	if (isCounting) {
+		allocations++;
+	}
+	void* pointer = malloc(size ? size : 1);
+	if (!pointer) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+	free(pointer);
+}
+
+typedef SimFlashStorage<0x100000> Storage;
+
+static bool holds(const Storage& storage, uint32_t offset, uint8_t value) {
+	uint8_t buffer[Storage::SECTOR_SIZE];
+	storage.read(offset, buffer, sizeof(buffer));
+	for (size_t i = 0; i < sizeof(buffer); i++) {
+		if (buffer[i] != value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(void) {
+	static Storage storage;
+	static uint8_t data[Storage::SECTOR_SIZE];
+
+	testCase() = "snapshot";
+	memset(data, 0xA5, sizeof(data));
+	storage.write(0, data, sizeof(data));
+	const Storage::Snapshot image = storage.snapshot();
+	memset(data, 0x5A, sizeof(data));
+	storage.write(0, data, sizeof(data));
+	storage.program(0x2000, data, sizeof(data));
+	check(holds(storage, 0, 0x5A) && holds(storage, 0x2000, 0x5A),
+		"writes applied");
+	check(storage.getSectors() == 2, "sectors stored");
+	static Storage copy;
+	copy.restore(image);
+	check(holds(copy, 0, 0xA5), "overwritten sector kept");
+	check(holds(copy, 0x2000, 0xFF), "new sector not in snapshot");
+	check(copy.getSectors() == 1, "snapshot sectors");
+
+	testCase() = "restore";
+	storage.restore(image);
+	check(holds(storage, 0, 0xA5) && holds(storage, 0x2000, 0xFF),
+		"old image");
+	check(storage.getSectors() == 1, "sectors");
+	// The snapshot stays valid for further restores.
+	storage.erase(0, Storage::SECTOR_SIZE);
+	check(holds(storage, 0, 0xFF) && storage.getSectors() == 0, "erase");
+	storage.restore(image);
+	check(holds(storage, 0, 0xA5), "restored again");
+
+	testCase() = "erased sectors";
+	memset(data, 0xFF, sizeof(data));
+	allocations = 0;
+	isCounting = true;
+	const bool erased = holds(storage, 0x80000, 0xFF);
+	storage.write(0x80000, data, sizeof(data));
+	storage.program(0x81000, data, sizeof(data));
+	storage.erase(0x82000, Storage::SECTOR_SIZE);
+	const bool stored = holds(storage, 0, 0xA5);
+	isCounting = false;
+	check(erased && stored, "contents");
+	check(allocations == 0, "no allocations");
+	check(storage.getSectors() == 1, "nothing stored");
+	data[0] = 0;
+	isCounting = true;
+	storage.program(0x80000, data, 1);
+	isCounting = false;
+	check(allocations > 0 && storage.getSectors() == 2,
+		"programmed sector allocated");
+	return report();
+}
@@ -0,0 +1,150 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks the NOR semantics of SimSpiDevice with raw commands: programs AND
+// into the page and wrap at its end, need the write enable latch and clear
+// it, and commands the flash would ignore count as protocol errors.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+typedef SimSpiDevice<0x100000, SpiFlashTimingW25Q, SimClock> Device;
+
+enum {
+	CMD_PAGE_PROGRAM = 0x02,
+	CMD_READ_DATA = 0x03,
+	CMD_READ_STATUS_REGISTER = 0x05,
+	CMD_WRITE_ENABLE = 0x06,
+	CMD_SECTOR_ERASE_4K = 0x20,
+};
+
+//! Issues a command with a 3-byte address followed by length bytes of data.
+static void command(Device& device, uint8_t opcode, uint32_t offset,
+		const uint8_t* data, size_t length) {
+	uint8_t buffer[4 + 512];
+	buffer[0] = opcode;
+	buffer[1] = static_cast<uint8_t>(offset >> 16);
+	buffer[2] = static_cast<uint8_t>(offset >> 8);
+	buffer[3] = static_cast<uint8_t>(offset);
+	if (length > 0) {
+		memcpy(&buffer[4], data, length);
+	}
+	device.transferBulk(buffer, 4 + length);
+}
+
+static void wait(Device& device) {
+	while (device.isOperationPending()) {
+		SimClock::sleep(100);
+	}
+}
+
+//! Programs data at offset with the write enable latch set.
+static void program(Device& device, uint32_t offset, const uint8_t* data,
+		size_t length) {
+	device.transfer(CMD_WRITE_ENABLE);
+	command(device, CMD_PAGE_PROGRAM, offset, data, length);
+	wait(device);
+}
+
+static bool holds(Device& device, uint32_t offset, uint8_t value,
+		size_t length) {
+	uint8_t buffer[256];
+	device.contents(offset, buffer, length);
+	for (size_t i = 0; i < length; i++) {
+		if (buffer[i] != value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(void) {
+	static Device device;
+	uint8_t data[256];
+
+	testCase() = "AND programming";
+	memset(data, 0xF0, sizeof(data));
+	program(device, 0x1000, data, 16);
+	memset(data, 0x3C, sizeof(data));
+	program(device, 0x1000, data, 16);
+	check(holds(device, 0x1000, 0x30, 16), "bits only cleared");
+	check(holds(device, 0x1010, 0xFF, 16), "rest of page untouched");
+	check(device.getPrograms() == 2, "programs");
+
+	testCase() = "page wrap";
+	memset(data, 0x00, sizeof(data));
+	program(device, 0x20F0, data, 32);
+	check(holds(device, 0x20F0, 0x00, 16), "end of page");
+	check(holds(device, 0x2000, 0x00, 16), "wrapped to start of page");
+	check(holds(device, 0x2010, 0xFF, 0xE0), "middle of page");
+	check(holds(device, 0x2100, 0xFF, 16), "next page untouched");
+
+	testCase() = "write enable latch";
+	device.resetCounters();
+	command(device, CMD_PAGE_PROGRAM, 0x3000, data, 16);
+	check(!device.isOperationPending() && device.getPrograms() == 0,
+		"program without latch ignored");
+	command(device, CMD_SECTOR_ERASE_4K, 0x1000, 0, 0);
+	check(!device.isOperationPending() && device.getErases() == 0,
+		"erase without latch ignored");
+	check(holds(device, 0x3000, 0xFF, 16), "not programmed");
+	device.transfer(CMD_WRITE_ENABLE);
+	check(device.isWriteEnableLatched(), "latch set");
+	command(device, CMD_SECTOR_ERASE_4K, 0x1000, 0, 0);
+	check(device.isOperationPending() && device.getErases() == 1, "erase");
+	wait(device);
+	check(!device.isWriteEnableLatched(), "latch cleared by erase");
+	check(holds(device, 0x1000, 0xFF, 16), "sector erased");
+	device.transfer(CMD_WRITE_ENABLE);
+	command(device, CMD_PAGE_PROGRAM, 0x3000, data, 16);
+	wait(device);
+	check(!device.isWriteEnableLatched(), "latch cleared by program");
+	command(device, CMD_PAGE_PROGRAM, 0x3100, data, 16);
+	check(!device.isOperationPending() && device.getPrograms() == 1,
+		"latch needed again");
+	check(device.getProtocolErrors() == 0, "no protocol errors");
+
+	testCase() = "protocol errors";
+	device.transfer(CMD_WRITE_ENABLE);
+	command(device, CMD_SECTOR_ERASE_4K, 0x2000, 0, 0);
+	// Only status reads are decoded while BUSY.
+	check(device.transferRegister(CMD_READ_STATUS_REGISTER, 0) & 0x01,
+		"busy");
+	command(device, CMD_READ_DATA, 0x2000, data, 16);
+	device.transfer(CMD_WRITE_ENABLE);
+	check(device.getProtocolErrors() == 2, "commands while busy");
+	wait(device);
+	check(holds(device, 0x2000, 0xFF, 16), "erase completed");
+	command(device, CMD_READ_DATA, 0x2000, data, 16);
+	check(device.getProtocolErrors() == 2, "read once idle");
+	return report();
+}
@@ -0,0 +1,197 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks that SpiFlash with SCRATCH_SIZE does not allocate: operator new is
+// replaced by a counting one, every operation of the driver is run once with
+// the heap and once with scratch buffers.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "SpiFlash.h"
+#include "SpiFlashTest.h"
+
+static bool isCounting = false;
+static unsigned long allocations = 0;
+
+void* operator new(size_t size) {
+	if (isCounting) {
+		allocations++;
+	}
+	void* pointer = malloc(size ? size : 1);
+	if (!pointer) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+	free(pointer);
+}
+
+//! SpiDevice of a 64k NOR flash in RAM that completes erases and programs at
+//! once. It has no transferIn(), so reads take the full-duplex path.
+class RamSpiDevice {
+	enum { SIZE = 0x10000 };
+
+	uint8_t memory[SIZE];
+	bool isWriteEnabled;
+
+	static uint32_t address(const uint8_t* header) {
+		return (static_cast<uint32_t>(header[1]) << 16) |
+			(static_cast<uint32_t>(header[2]) << 8) | header[3];
+	}
+
+	void erase(uint32_t offset, size_t bytes) {
+		if (isWriteEnabled) {
+			memset(&memory[offset & ~(bytes - 1)], 0xFF, bytes);
+		}
+		isWriteEnabled = false;
+	}
+
+public:
+	RamSpiDevice() : isWriteEnabled(false) {
+		memset(memory, 0xFF, sizeof(memory));
+	}
+	void master(void) {}
+	uint8_t transfer(uint8_t data) {
+		if (data == 0x06) {
+			isWriteEnabled = true;
+		}
+		return 0;
+	}
+	uint8_t transferRegister(uint8_t, uint8_t) {
+		// Never busy.
+		return 0;
+	}
+	void transferBulk(uint8_t* buffer, size_t length) {
+		const uint32_t offset = address(buffer);
+		switch (buffer[0]) {
+		case 0x03:
+			memcpy(&buffer[4], &memory[offset], length - 4);
+			break;
+		case 0x02:
+			for (size_t i = 4; i < length && isWriteEnabled; i++) {
+				const uint32_t at = (offset & ~0xFFul) | ((offset + i - 4) & 0xFF);
+				memory[at] &= buffer[i];
+			}
+			isWriteEnabled = false;
+			break;
+		case 0x20:
+			erase(offset, 0x1000);
+			break;
+		case 0x52:
+			erase(offset, 0x8000);
+			break;
+		case 0xD8:
+			erase(offset, 0x10000);
+			break;
+		}
+	}
+};
+
+template<size_t SCRATCH_SIZE>
+struct Flash {
+	typedef SpiFlash<RamSpiDevice, 0x10000, SpiFlashReadNormal,
+		SpiFlashAddress3Byte, SpiFlashWaitSpin<>, SpiFlashTimingW25Q,
+		SpiFlashStatsNone, SCRATCH_SIZE> Type;
+};
+
+//! Runs every operation that may need a transfer buffer.
+template<size_t SCRATCH_SIZE>
+static void exercise(typename Flash<SCRATCH_SIZE>::Type& flash) {
+	static uint8_t data[0x3000];
+	static uint8_t readback[0x3000];
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = static_cast<uint8_t>(i * 7 + 1);
+	}
+	check(flash.init() == SpiFlashErrorSuccess, "init");
+	check(flash.erase(0, 0x10000, 0, SpiFlashEraseBlankCheck) ==
+		SpiFlashErrorSuccess, "blank check erase");
+	check(flash.write(data, 13, 0x1000) == SpiFlashErrorSuccess, "write");
+	check(flash.write(data, 0x2000, 0x1000, SpiFlashWriteVerify) ==
+		SpiFlashErrorSuccess, "verified write");
+	check(flash.read(readback, 0x2000, 0x1000) == SpiFlashErrorSuccess &&
+		memcmp(readback, data, 0x1000) == 0, "read");
+	// Setting bits rewrites the sectors.
+	data[5] = 0xFF;
+	check(flash.update(data, 0x2000, 0x3000) == SpiFlashErrorSuccess,
+		"update");
+	check(flash.read(readback, 0x2000, 0x3000) == SpiFlashErrorSuccess &&
+		memcmp(readback, data, 0x3000) == 0, "read after update");
+	check(flash.erase(0, 0x10000, 0, SpiFlashEraseBlankCheck) ==
+		SpiFlashErrorSuccess, "blank check erase");
+	check(flash.beginWrite(data, 0x8000, 0x1000) == SpiFlashErrorSuccess,
+		"begin write");
+	// Reads while the job holds its page buffer.
+	while (flash.poll() == SpiFlashErrorBusy) {
+		check(flash.read(readback, 0, 16) == SpiFlashErrorSuccess,
+			"read during write");
+	}
+	check(flash.read(readback, 0x8000, 0x1000) == SpiFlashErrorSuccess &&
+		memcmp(readback, data, 0x1000) == 0, "read after begin write");
+	check(flash.beginErase(0x8000, 0x1000) == SpiFlashErrorSuccess,
+		"begin erase");
+	while (flash.poll() == SpiFlashErrorBusy) {
+	}
+}
+
+//! Counts the allocations of exercise().
+template<size_t SCRATCH_SIZE>
+static unsigned long countAllocations(void) {
+	static typename Flash<SCRATCH_SIZE>::Type flash;
+	allocations = 0;
+	isCounting = true;
+	exercise<SCRATCH_SIZE>(flash);
+	isCounting = false;
+	return allocations;
+}
+
+int main(void) {
+	// Shows that the replaced operator new is in use.
+	testCase() = "heap mode";
+	check(countAllocations<0>() > 0, "allocates");
+	enum { SCRATCH_SIZE = Flash<0>::Type::UPDATE_SCRATCH_SIZE };
+	testCase() = "scratch mode";
+	const unsigned long count = countAllocations<SCRATCH_SIZE>();
+	check(count == 0, "does not allocate");
+	if (count) {
+		printf("%lu allocations with scratch\n", count);
+	}
+	return report();
+}
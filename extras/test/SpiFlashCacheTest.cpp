@@ -0,0 +1,57 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks the replacement order of SpiFlashCache: lines prefetched for a
+// sequential stream are evicted before the line the stream is using.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "SpiFlash.h"
+#include "SpiFlashCache.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+typedef SpiFlash<SimSpiDevice<0x100000>, 0x100000, SpiFlashReadFast> Flash;
+
+int main(void) {
+	static Flash flash;
+	flash.init();
+	SpiFlashCache<Flash, 1024, 256> cache(flash);
+	uint8_t buffer[16];
+	// Sequential reads in line 0 prefetch lines 1 and 2.
+	check(cache.read(buffer, 0, 16) == SpiFlashErrorSuccess, "read");
+	check(cache.read(buffer, 16, 16) == SpiFlashErrorSuccess, "read");
+	check(cache.getPrefetches() == 2, "prefetches");
+	// Random misses fill the free line, then evict a prefetched line.
+	check(cache.read(buffer, 0x10000, 16) == SpiFlashErrorSuccess, "read");
+	check(cache.read(buffer, 0x20000, 16) == SpiFlashErrorSuccess, "read");
+	cache.resetCounters();
+	check(cache.read(buffer, 32, 16) == SpiFlashErrorSuccess, "read");
+	check(cache.getHits() == 1 && cache.getMisses() == 0,
+		"line in use kept");
+	return report();
+}
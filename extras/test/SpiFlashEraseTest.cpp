@@ -0,0 +1,100 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks that erases above 64k erase the requested range only, through
+// beginErase(), erase() and the blank check erase.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+typedef SpiFlash<SimSpiDevice<0x100000, SpiFlashTimingW25Q, SimClock>,
+	0x100000, SpiFlashReadFast, SpiFlashAddress3Byte,
+	SpiFlashWaitSpin<SimClock> > Flash;
+
+static const uint8_t data[16] = {
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+};
+
+//! Whether the bytes at offset hold data.
+static bool holdsData(Flash& flash, uint32_t offset) {
+	uint8_t buffer[sizeof(data)];
+	return flash.read(buffer, offset, sizeof(buffer)) == SpiFlashErrorSuccess &&
+		memcmp(buffer, data, sizeof(buffer)) == 0;
+}
+
+//! Whether the bytes at offset are erased.
+static bool isErased(Flash& flash, uint32_t offset) {
+	uint8_t buffer[sizeof(data)];
+	return flash.read(buffer, offset, sizeof(buffer)) == SpiFlashErrorSuccess &&
+		SpiFlashDetail::isErased(buffer, sizeof(buffer));
+}
+
+//! Programs sector 0 and the sector at offset.
+static void program(Flash& flash, uint32_t offset) {
+	check(flash.write(data, 0, sizeof(data)) == SpiFlashErrorSuccess &&
+		flash.write(data, offset, sizeof(data)) == SpiFlashErrorSuccess,
+		"write");
+}
+
+int main(void) {
+	static Flash flash;
+	flash.init();
+	flash.erase(0, Flash::CAPACITY);
+
+	testCase() = "beginErase()";
+	program(flash, 0x10000);
+	check(flash.beginErase(0x10000, 0x1000) == SpiFlashErrorSuccess,
+		"begin erase");
+	while (flash.poll() == SpiFlashErrorBusy) {
+		SimClock::sleep(1000);
+	}
+	check(isErased(flash, 0x10000), "range erased");
+	check(holdsData(flash, 0), "sector 0 untouched");
+	flash.erase(0, 0x1000);
+
+	testCase() = "erase()";
+	program(flash, 0x30000);
+	check(flash.erase(0x30000, 0x10000) == SpiFlashErrorSuccess, "erase");
+	check(isErased(flash, 0x30000), "range erased");
+	check(holdsData(flash, 0), "sector 0 untouched");
+	flash.erase(0, 0x1000);
+
+	testCase() = "blank check erase()";
+	program(flash, 0x81000);
+	SpiFlashErasePlan plan;
+	check(flash.erase(0x80000, 0x2000, &plan, SpiFlashEraseBlankCheck) ==
+		SpiFlashErrorSuccess, "erase");
+	check(plan.sectors == 1 && plan.skipped == 1, "plan");
+	check(isErased(flash, 0x81000), "range erased");
+	check(holdsData(flash, 0), "sector 0 untouched");
+
+	return report();
+}
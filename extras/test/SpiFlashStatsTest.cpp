@@ -0,0 +1,154 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks SpiFlashStats: calls, errors and bytes per operation, the poll,
+// command and timeout counters, histogram percentiles and reset().
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+#include "SpiFlashStats.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+//! W25Q timing with page programs slower than the W25Q maximum, so the
+//! simulated flash outlasts the driver's timeout.
+struct SlowTiming : SpiFlashTimingW25Q {
+	static constexpr uint32_t typical(SpiFlashOperation operation) {
+		return (operation == SpiFlashOperationPageProgram) ?
+			2 * SpiFlashTimingW25Q::maximum(operation) :
+			SpiFlashTimingW25Q::typical(operation);
+	}
+};
+
+template<typename SimTiming>
+struct StatsFlash {
+	typedef SimSpiDevice<0x100000, SimTiming, SimClock> Device;
+	typedef SpiFlash<Device, 0x100000, SpiFlashReadFast, SpiFlashAddress3Byte,
+		SpiFlashWaitSpin<SimClock>, SpiFlashTimingW25Q,
+		SpiFlashStats<SimClock> > Type;
+};
+
+typedef StatsFlash<SpiFlashTimingW25Q>::Type Flash;
+typedef StatsFlash<SlowTiming>::Type SlowFlash;
+
+static void checkHistogram(void) {
+	testCase() = "histogram";
+	static SpiFlashHistogram histogram;
+	memset(&histogram, 0, sizeof(histogram));
+	check(histogram.getPercentile(50) == 0, "empty");
+	for (uint32_t value = 1; value <= 100; value++) {
+		histogram.add(value);
+	}
+	// 50 falls in [48, 55], 99 and 100 in [96, 111].
+	check(histogram.getPercentile(0) == 1, "minimum");
+	check(histogram.getPercentile(50) == 55, "median");
+	check(histogram.getPercentile(99) == 111, "99th percentile");
+	check(histogram.getPercentile(100) == 111, "maximum");
+	check(SpiFlashHistogram::bucket(0xFFFFFFFFul) + 1 ==
+		SpiFlashHistogram::BUCKETS, "whole range");
+}
+
+static void checkOperations(void) {
+	testCase() = "operations";
+	static Flash flash;
+	static uint8_t data[300];
+	memset(data, 0x5A, sizeof(data));
+	uint8_t buffer[100];
+	check(flash.init() == SpiFlashErrorSuccess, "init");
+	flash.stats().reset();
+	flash.device().resetCounters();
+	const uint32_t polls = flash.waitStrategy().getPolls();
+
+	check(flash.read(buffer, 0, sizeof(buffer)) == SpiFlashErrorSuccess,
+		"read");
+	check(flash.read(buffer, 0x1000, sizeof(buffer)) == SpiFlashErrorSuccess,
+		"read");
+	check(flash.read(buffer, 0x100000, sizeof(buffer)) != SpiFlashErrorSuccess,
+		"read out of range");
+	check(flash.write(data, 0, sizeof(data)) == SpiFlashErrorSuccess, "write");
+	check(flash.erase(0x1000, 0x1000) == SpiFlashErrorSuccess, "erase");
+	for (int i = 0; i < 3; i++) {
+		flash.getStatus();
+	}
+
+	SpiFlashStatsSnapshot snapshot = flash.stats().snapshot();
+	const SpiFlashCallStats& read = snapshot.operations[SpiFlashStatRead];
+	check(read.calls == 3 && read.errors == 1, "read calls");
+	check(read.bytes == 2 * sizeof(buffer), "read bytes");
+	const SpiFlashCallStats& write = snapshot.operations[SpiFlashStatWrite];
+	check(write.calls == 1 && write.errors == 0 &&
+		write.bytes == sizeof(data), "write");
+	const SpiFlashCallStats& erase = snapshot.operations[SpiFlashStatErase];
+	check(erase.calls == 1 && erase.errors == 0 && erase.bytes == 0x1000,
+		"erase");
+	const SpiFlashCallStats& status =
+		snapshot.operations[SpiFlashStatGetStatus];
+	// Every status poll of a wait is a getStatus() call too.
+	check(status.calls == snapshot.polls + 3 && status.bytes == status.calls,
+		"getStatus");
+	check(snapshot.operations[SpiFlashStatWait].calls > 0, "waits");
+	check(snapshot.polls == flash.waitStrategy().getPolls() - polls &&
+		snapshot.polls > snapshot.operations[SpiFlashStatWait].calls,
+		"polls");
+	check(snapshot.commands == flash.device().getTransactions(), "commands");
+	check(snapshot.timeouts == 0, "no timeouts");
+	// The erase is the slowest call and lands in the top bucket.
+	check(erase.maximumUs >= SpiFlashTimingW25Q::typical(
+		SpiFlashOperationSectorErase), "erase latency");
+	check(erase.latencyUs.getPercentile(100) == SpiFlashHistogram::highest(
+		SpiFlashHistogram::bucket(erase.maximumUs)), "erase percentile");
+
+	flash.stats().reset();
+	static SpiFlashStatsSnapshot zero;
+	snapshot = flash.stats().snapshot();
+	check(memcmp(&snapshot, &zero, sizeof(zero)) == 0, "reset");
+}
+
+static void checkTimeout(void) {
+	testCase() = "timeout";
+	static SlowFlash flash;
+	static const uint8_t data[16] = { 0x5A };
+	check(flash.init() == SpiFlashErrorSuccess, "init");
+	flash.stats().reset();
+	check(flash.write(data, 0, sizeof(data)) == SpiFlashErrorTimeout,
+		"write times out");
+	const SpiFlashStatsSnapshot snapshot = flash.stats().snapshot();
+	check(snapshot.timeouts == 1, "timeouts");
+	check(snapshot.operations[SpiFlashStatWait].errors == 1, "wait error");
+	check(snapshot.operations[SpiFlashStatWrite].errors == 1 &&
+		snapshot.operations[SpiFlashStatWrite].bytes == 0, "write error");
+}
+
+int main(void) {
+	checkHistogram();
+	checkOperations();
+	checkTimeout();
+	return report();
+}
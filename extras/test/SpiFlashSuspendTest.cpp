@@ -0,0 +1,83 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks that reads suspending an erase in continuous read mode resume it:
+// the erase must complete and the simulator must not see a command the flash
+// would ignore.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "SpiFlash.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+//! Erases two 64k blocks at offset while reading the block before them.
+template<uint32_t FLASH_SIZE, typename Addressing>
+static void readDuringErase(uint32_t offset) {
+	typedef SimSpiDevice<FLASH_SIZE, SpiFlashTimingW25Q, SimClock> Device;
+	static SpiFlash<Device, FLASH_SIZE, SpiFlashReadQuadIOContinuous,
+		Addressing, SpiFlashWaitSpin<SimClock> > flash;
+	static const uint8_t data[16] = { 0x5A };
+	uint8_t buffer[sizeof(data)];
+	SimClock::reset();
+	check(flash.init() == SpiFlashErrorSuccess, "init");
+	check(flash.write(data, offset - 0x10000, sizeof(data)) ==
+		SpiFlashErrorSuccess, "write");
+	check(flash.write(data, offset, sizeof(data)) == SpiFlashErrorSuccess,
+		"write");
+	SpiFlashHandle handle = 0;
+	check(flash.beginErase(offset, 0x20000, &handle) == SpiFlashErrorSuccess,
+		"begin erase");
+	int result;
+	unsigned reads = 0;
+	while ((result = flash.poll()) == SpiFlashErrorBusy) {
+		// Two reads in a row leave continuous read mode armed.
+		if (reads < 4) {
+			check(flash.read(buffer, offset - 0x10000, sizeof(buffer)) ==
+				SpiFlashErrorSuccess && buffer[0] == data[0],
+				"read during erase");
+			reads++;
+		}
+		SimClock::sleep(1000);
+	}
+	check(result == SpiFlashErrorSuccess, "erase result");
+	check(reads > 0, "erase suspended");
+	Device& device = flash.device();
+	check(!device.isOperationPending(), "erase completed");
+	check(device.getProtocolErrors() == 0, "no protocol errors");
+	check(flash.read(buffer, offset, sizeof(buffer)) == SpiFlashErrorSuccess &&
+		buffer[0] == 0xFF, "read after erase");
+}
+
+int main(void) {
+	testCase() = "1 MB, 3-byte addresses";
+	readDuringErase<0x100000, SpiFlashAddress3Byte>(0x20000);
+	testCase() = "32 MB, 4-byte opcodes";
+	readDuringErase<0x2000000, SpiFlashAddress4ByteOpcodes>(0x1000000);
+	return report();
+}
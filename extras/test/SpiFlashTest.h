@@ -0,0 +1,66 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+#ifndef SPI_FLASH_TEST_H
+#define SPI_FLASH_TEST_H
+
+#include <stdio.h>
+
+// Checks shared by the tests. Each test is a program of its own that calls
+// check() and returns report() from main().
+
+//! Number of failed checks.
+inline int& testFailures(void) {
+	static int failures = 0;
+	return failures;
+}
+
+//! Configuration under test, printed with failures.
+inline const char*& testCase(void) {
+	static const char* name = "";
+	return name;
+}
+
+//! Counts and prints a failed check.
+inline void check(bool condition, const char* what) {
+	if (!condition) {
+		printf("FAILED: %s%s%s\n", what, *testCase() ? " in " : "",
+			testCase());
+		testFailures()++;
+	}
+}
+
+//! Prints the result.
+//! \returns Exit code of the test, 0 if all checks passed.
+inline int report(void) {
+	if (testFailures()) {
+		printf("%d failures\n", testFailures());
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
+
+#endif // SPI_FLASH_TEST_H
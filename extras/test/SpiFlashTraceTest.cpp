@@ -0,0 +1,224 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks SpiFlashTrace: recorded opcodes and addresses, merging of back to
+// back status polls, the ring buffer and the Chrome trace export.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+#include "SpiFlashTrace.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+enum { EVENTS = 8 };
+
+typedef SimSpiDevice<0x100000, SpiFlashTimingW25Q, SimClock> Device;
+typedef SpiFlashTrace<Device, SimClock, EVENTS> Trace;
+typedef SpiFlash<Trace, 0x100000, SpiFlashReadNormal, SpiFlashAddress3Byte,
+	SpiFlashWaitSpin<SimClock> > Flash;
+
+//! Minimal JSON syntax check, enough for the trace export.
+class JsonParser {
+	const char* next;
+
+	void skipSpace(void) {
+		while (*next == ' ' || *next == '\n' || *next == '\r' ||
+				*next == '\t') {
+			next++;
+		}
+	}
+
+	bool parseString(void) {
+		if (*next++ != '"') {
+			return false;
+		}
+		while (*next && *next != '"') {
+			if (*next++ == '\\' && !*next++) {
+				return false;
+			}
+		}
+		return *next++ == '"';
+	}
+
+	bool parseNumber(void) {
+		const char* start = next;
+		if (*next == '-') {
+			next++;
+		}
+		while ((*next >= '0' && *next <= '9') || *next == '.' ||
+				*next == 'e' || *next == 'E' || *next == '+') {
+			next++;
+		}
+		return next != start;
+	}
+
+	//! Parses the members of an object or the elements of an array.
+	bool parseList(char close, bool isObject) {
+		next++;
+		skipSpace();
+		if (*next == close) {
+			next++;
+			return true;
+		}
+		while (true) {
+			skipSpace();
+			if (isObject) {
+				if (!parseString()) {
+					return false;
+				}
+				skipSpace();
+				if (*next++ != ':') {
+					return false;
+				}
+			}
+			if (!parseValue()) {
+				return false;
+			}
+			skipSpace();
+			if (*next == close) {
+				next++;
+				return true;
+			}
+			if (*next++ != ',') {
+				return false;
+			}
+		}
+	}
+
+	bool parseValue(void) {
+		skipSpace();
+		switch (*next) {
+		case '{':
+			return parseList('}', true);
+		case '[':
+			return parseList(']', false);
+		case '"':
+			return parseString();
+		case 't':
+		case 'f':
+		case 'n': {
+			const char* word = (*next == 't') ? "true" :
+				((*next == 'f') ? "false" : "null");
+			const size_t length = strlen(word);
+			if (strncmp(next, word, length) != 0) {
+				return false;
+			}
+			next += length;
+			return true;
+		}
+		default:
+			return parseNumber();
+		}
+	}
+
+public:
+	//! Whether text is exactly one well-formed JSON value.
+	bool isValid(const char* text) {
+		next = text;
+		if (!parseValue()) {
+			return false;
+		}
+		skipSpace();
+		return *next == '\0';
+	}
+};
+
+int main(void) {
+	static Flash flash;
+	Trace& trace = flash.device();
+	static const uint8_t data[16] = { 0x5A };
+	flash.init();
+
+	testCase() = "page program";
+	trace.clear();
+	trace.device().resetCounters();
+	check(flash.write(data, 0x1234, sizeof(data)) == SpiFlashErrorSuccess,
+		"write");
+	size_t program = trace.getEvents();
+	size_t transactions = 0;
+	for (size_t i = 0; i < trace.getEvents(); i++) {
+		const SpiFlashTraceEvent& event = trace.getEvent(i);
+		transactions += event.polls ? event.polls : 1;
+		if (event.opcode == 0x02) {
+			program = i;
+		}
+	}
+	check(program > 0 && trace.getEvent(program - 1).opcode == 0x06,
+		"write enable first");
+	check(program < trace.getEvents() &&
+		trace.getEvent(program).address == 0x1234 &&
+		trace.getEvent(program).length == 4 + sizeof(data), "page program");
+	// The busy wait is one event.
+	check(program + 2 == trace.getEvents() &&
+		trace.getEvent(program + 1).opcode == 0x05 &&
+		trace.getEvent(program + 1).polls > 1, "merged polls");
+	check(transactions == trace.device().getTransactions(), "poll count");
+
+	testCase() = "idle gap";
+	trace.clear();
+	flash.getStatus();
+	SimClock::sleep(100);
+	flash.getStatus();
+	check(trace.getEvents() == 2 && trace.getEvent(0).polls == 1 &&
+		trace.getEvent(1).polls == 1, "polls not merged");
+
+	testCase() = "ring buffer";
+	trace.clear();
+	uint8_t buffer[4];
+	for (uint32_t i = 0; i < EVENTS + 4; i++) {
+		flash.read(buffer, i * 0x100, sizeof(buffer));
+	}
+	check(trace.getEvents() == EVENTS, "events");
+	check(trace.getDropped() == 4, "dropped");
+	bool isOrdered = true;
+	for (size_t i = 0; i < trace.getEvents(); i++) {
+		isOrdered = isOrdered && trace.getEvent(i).opcode == 0x03 &&
+			trace.getEvent(i).address == (i + 4) * 0x100;
+	}
+	check(isOrdered, "oldest events dropped");
+
+	testCase() = "Chrome trace";
+	FILE* file = tmpfile();
+	check(file && trace.writeChromeTrace(file) == SpiFlashErrorSuccess,
+		"export");
+	if (file) {
+		static char text[8192];
+		rewind(file);
+		const size_t length = fread(text, 1, sizeof(text) - 1, file);
+		text[length] = '\0';
+		fclose(file);
+		JsonParser parser;
+		check(parser.isValid(text), "well-formed JSON");
+		check(strstr(text, "\"address\":\"0x000B00\"") != 0, "last read");
+	}
+	check(!JsonParser().isValid("{\"a\":1,}"), "parser rejects errors");
+
+	return report();
+}
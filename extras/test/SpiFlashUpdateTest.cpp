@@ -0,0 +1,109 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks that update() programs in place where it can, rewrites only sectors
+// where a bit must be set and keeps the bytes around the range.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+typedef SimSpiDevice<0x100000, SpiFlashTimingW25Q, SimClock> Device;
+typedef SpiFlash<Device, 0x100000, SpiFlashReadFast, SpiFlashAddress3Byte,
+	SpiFlashWaitSpin<SimClock> > Flash;
+
+static Flash flash;
+static uint8_t image[0x3000];
+static uint8_t buffer[0x3000];
+
+//! Programs image, a pattern with bits to clear and to set, at 0x1000.
+static void reset(void) {
+	for (size_t i = 0; i < sizeof(image); i++) {
+		image[i] = static_cast<uint8_t>(0x55 ^ i);
+	}
+	flash.erase(0, 0x10000);
+	flash.write(image, 0x1000, sizeof(image));
+	flash.device().resetCounters();
+}
+
+//! Whether the flash holds image at 0x1000.
+static bool holdsImage(void) {
+	return flash.read(buffer, 0x1000, sizeof(buffer)) == SpiFlashErrorSuccess &&
+		memcmp(buffer, image, sizeof(image)) == 0;
+}
+
+//! Updates bytes of image at offset from 0x1000 with data.
+static bool update(size_t offset, const uint8_t* data, size_t bytes) {
+	memcpy(&image[offset], data, bytes);
+	return flash.update(data, 0x1000 + offset, bytes) ==
+		SpiFlashErrorSuccess;
+}
+
+int main(void) {
+	flash.init();
+
+	testCase() = "bit clear";
+	reset();
+	uint8_t value = image[0x123] & 0xF0;
+	check(update(0x123, &value, 1), "update");
+	check(flash.device().getPrograms() == 1, "one page program");
+	check(flash.device().getErases() == 0, "no erase");
+	check(holdsImage(), "contents");
+
+	testCase() = "bit set";
+	reset();
+	value = image[0x123] | 0x0F;
+	check(update(0x123, &value, 1), "update");
+	check(flash.device().getErases() == 1, "one sector rewrite");
+	// Every page of the sector holds data and is programmed again.
+	check(flash.device().getPrograms() == 16, "sector programmed");
+	check(holdsImage(), "contents");
+
+	testCase() = "two sectors";
+	reset();
+	uint8_t data[0x200];
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = static_cast<uint8_t>(~image[0xF00 + i]);
+	}
+	check(update(0xF00, data, sizeof(data)), "update");
+	check(flash.device().getErases() == 2, "two sector rewrites");
+	// holdsImage() also covers the bytes around the range.
+	check(holdsImage(), "contents");
+
+	testCase() = "unchanged";
+	reset();
+	memcpy(data, &image[0x800], sizeof(data));
+	check(update(0x800, data, sizeof(data)), "update");
+	check(flash.device().getPrograms() == 0, "no page program");
+	check(flash.device().getErases() == 0, "no erase");
+	check(holdsImage(), "contents");
+
+	return report();
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks write() with SpiFlashWriteVerify: a page that can not be programmed
+// is retried once and reported, clean writes succeed. Also checks the
+// CRC-32C: the test is built as is and, on x86, once more with SSE4.2.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+typedef SimSpiDevice<0x100000, SpiFlashTimingW25Q, SimClock> Device;
+typedef SpiFlash<Device, 0x100000, SpiFlashReadFast, SpiFlashAddress3Byte,
+	SpiFlashWaitSpin<SimClock> > Flash;
+
+int main(void) {
+	testCase() = "crc32c";
+	const uint8_t* digits = reinterpret_cast<const uint8_t*>("123456789");
+	check(SpiFlashDetail::crc32c(0, digits, 9) == 0xE3069283ul,
+		"check value");
+	check(SpiFlashDetail::crc32c(SpiFlashDetail::crc32c(0, digits, 5),
+		&digits[5], 4) == 0xE3069283ul, "continued");
+	check(SpiFlashDetail::crc32c(0, digits, 0) == 0, "empty");
+
+	static Flash flash;
+	static uint8_t data[0x200];
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = static_cast<uint8_t>(i | 0x80);
+	}
+	flash.init();
+
+	testCase() = "failing page";
+	// The second page is programmed to 0x00, its data can not be written.
+	static const uint8_t zeros[256] = { 0 };
+	flash.write(zeros, 0x1100, sizeof(zeros));
+	flash.device().resetCounters();
+	uint32_t failed = 0;
+	check(flash.write(data, 0x1000, sizeof(data), SpiFlashWriteVerify,
+		&failed) == SpiFlashErrorVerify, "result");
+	check(failed == 0x1100, "failed page");
+	check(flash.device().getPrograms() == 3, "one retry");
+
+	testCase() = "clean write";
+	flash.device().resetCounters();
+	failed = 0;
+	check(flash.write(data, 0x2000, sizeof(data), SpiFlashWriteVerify,
+		&failed) == SpiFlashErrorSuccess, "result");
+	check(failed == 0, "no failed page");
+	check(flash.device().getPrograms() == 2, "no retry");
+	uint8_t buffer[sizeof(data)];
+	check(flash.read(buffer, 0x2000, sizeof(buffer)) == SpiFlashErrorSuccess &&
+		memcmp(buffer, data, sizeof(data)) == 0, "contents");
+
+	return report();
+}
@@ -0,0 +1,102 @@
+/*******************************************************************************
+The MIT License (MIT)
+
+Copyright (c) 2016 Julian Sanin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*******************************************************************************/
+
+
+// Checks the error paths of SpiFlashWriteBuffer: a failed flush or erase
+// keeps the buffered page, writes outside the flash are rejected at once.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "SpiFlash.h"
+#include "SpiFlashWriteBuffer.h"
+#include "extras/sim/SimClock.h"
+#include "extras/sim/SimSpiDevice.h"
+#include "SpiFlashTest.h"
+
+typedef SpiFlash<SimSpiDevice<0x100000, SpiFlashTimingW25Q, SimClock>,
+	0x100000, SpiFlashReadFast, SpiFlashAddress3Byte,
+	SpiFlashWaitSpin<SimClock> > Flash;
+
+static bool contains(Flash& flash, uint32_t offset, const uint8_t* data,
+		size_t bytes) {
+	uint8_t buffer[16];
+	return flash.read(buffer, offset, bytes) == SpiFlashErrorSuccess &&
+		memcmp(buffer, data, bytes) == 0;
+}
+
+int main(void) {
+	static Flash flash;
+	SpiFlashWriteBuffer<Flash> buffer(flash);
+	static const uint8_t data[16] = {
+		1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+	};
+	static const uint8_t erased[16] = {
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+	};
+	flash.init();
+
+	// A flush failing while a job runs keeps the page.
+	check(flash.beginErase(0x80000, 0x10000) == SpiFlashErrorSuccess,
+		"begin erase");
+	check(buffer.write(data, 0x1000, sizeof(data)) == SpiFlashErrorSuccess,
+		"buffered write");
+	check(buffer.flush() == SpiFlashErrorBusy, "flush during job");
+	check(buffer.flush() == SpiFlashErrorBusy, "second flush during job");
+	while (flash.poll() == SpiFlashErrorBusy) {
+		SimClock::sleep(1000);
+	}
+	check(buffer.flush() == SpiFlashErrorSuccess, "flush after job");
+	check(contains(flash, 0x1000, data, sizeof(data)), "flushed data");
+
+	// An erase failing validation keeps the page.
+	check(buffer.write(data, 0x200, sizeof(data)) == SpiFlashErrorSuccess,
+		"buffered write");
+	check(buffer.erase(0, 0x300) == SpiFlashErrorInputValue,
+		"unaligned erase");
+	check(buffer.flush() == SpiFlashErrorSuccess, "flush after erase");
+	check(contains(flash, 0x200, data, sizeof(data)), "data kept by erase");
+
+	// An erase covering the page drops it.
+	check(buffer.write(data, 0x2010, sizeof(data)) == SpiFlashErrorSuccess,
+		"buffered write");
+	check(buffer.erase(0x2000, 0x1000) == SpiFlashErrorSuccess,
+		"covering erase");
+	const uint32_t programs = buffer.getPrograms();
+	check(buffer.flush() == SpiFlashErrorSuccess &&
+		buffer.getPrograms() == programs, "page dropped by erase");
+	check(contains(flash, 0x2010, erased, sizeof(erased)), "erased data");
+
+	// Writes beyond the flash are rejected right away.
+	check(buffer.write(data, Flash::CAPACITY + 0x1000, 4) ==
+		SpiFlashErrorInputValue, "write beyond flash");
+	check(buffer.write(data, Flash::CAPACITY - 2, 4) ==
+		SpiFlashErrorInputValue, "write across end of flash");
+	check(buffer.flush() == SpiFlashErrorSuccess, "flush after rejects");
+
+	return report();
+}